@@ -0,0 +1,96 @@
+// rt11.h - RT-11 disk images as a library (librt11).
+//
+// A Volume opens one image and works on its directory and files without
+// writing to the console.  Every call returns an Error; lastError() holds
+// the message of the most recent failure.  Directory changes are written
+// to the image when the call that made them returns.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rt11 {
+
+enum class Error {
+    None = 0,
+    NotOpen,          // no image is open
+    OpenFailed,       // image missing, unreadable or too small
+    ReadOnly,         // write to an image opened read-only
+    Io,               // read, write or flush failed, or block out of range
+    BadDirectory,     // directory structure is damaged
+    NotFound,         // no permanent file of that name
+    Exists,           // file exists and replacing was not asked for
+    InvalidName,      // not a NAME.EXT of 1-6 and 0-3 RAD50 characters
+    InvalidArgument,  // block range outside the file, bad size
+    DirectoryFull,    // no directory segment left to split into
+    NoSpace,          // no empty area large enough
+    Failed            // anything else
+};
+
+const char* errorText(Error error);
+
+// Choice of empty area for a new file, as /alloc: on the command line
+enum class Placement { FirstFit, BestFit, WorstFit, Rt11 };
+
+struct FileInfo {
+    std::string name;           // NAME.EXT, upper case
+    uint16_t status = 0;        // raw status word
+    uint32_t startBlock = 0;
+    uint32_t lengthBlocks = 0;
+    uint16_t dateWord = 0;      // RT-11 packed date
+    uint16_t segment = 0;       // directory segment holding the entry
+
+    bool permanent() const { return (status & 0x0400) != 0; }
+    bool empty() const     { return (status & 0x0200) != 0; }
+    bool tentative() const { return (status & 0x0100) != 0; }
+};
+
+class Volume {
+public:
+    Volume();
+    ~Volume();
+
+    Volume(Volume&&) noexcept;
+    Volume& operator=(Volume&&) noexcept;
+    Volume(const Volume&) = delete;
+    Volume& operator=(const Volume&) = delete;
+
+    Error open(const std::string& path, bool writable = false);
+    void close();
+    bool isOpen() const;
+    bool writable() const;
+    uint32_t totalBlocks() const;
+
+    // Directory entries in directory order; empty areas and tentative files
+    // only with `all`.
+    Error directory(std::vector<FileInfo>& files, bool all = false);
+    Error find(const std::string& name, FileInfo& file);
+    Error freeSpace(uint32_t& freeBlocks, uint32_t& largestArea);
+
+    // Creates a permanent file of `blocks` blocks without writing its data.
+    // A zero date word stands for today.
+    Error allocate(const std::string& name, uint32_t blocks, FileInfo& file,
+                   uint16_t dateWord = 0, Placement placement = Placement::FirstFit);
+
+    Error readFile(const std::string& name, std::vector<uint8_t>& data);
+    Error readBlocks(const FileInfo& file, uint32_t block, uint32_t count, uint8_t* data);
+    Error writeBlocks(const FileInfo& file, uint32_t block, uint32_t count, const uint8_t* data);
+
+    // Allocates a file for `bytes` of data and writes it, zero-padding the
+    // last block.  With `replace`, an existing file of the same name is
+    // deleted once the new one is complete; otherwise it is an error.
+    Error writeFile(const std::string& name, const uint8_t* data, size_t bytes,
+                    bool replace = false, uint16_t dateWord = 0,
+                    Placement placement = Placement::FirstFit);
+
+    const std::string& lastError() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace rt11
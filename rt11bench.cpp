@@ -0,0 +1,569 @@
+// Benchmark harness for rt11dir.
+//
+// Builds a synthetic RT-11 image (or takes an existing one with /image:),
+// then times the directory and copy paths of librt11 against it and
+// reports throughput and the I/O calls the process made.
+
+#include "rt11engine.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// ------------------------------
+// Synthetic image generator
+// ------------------------------
+const uint16_t BENCH_DATE = (1 << 10) | (15 << 5) | (93 - 72);  // 15-JAN-93
+
+struct ImageSpec {
+    uint32_t totalBlocks = 65535;
+    uint16_t segments    = 31;
+    uint16_t extraBytes  = 0;
+    uint32_t files       = 1000;
+    uint32_t minBlocks   = 1;
+    uint32_t maxBlocks   = 40;
+    bool logSizes        = false;  // sizes spread evenly over log(size), not size
+    double fragmentation = 0.0;    // chance of an empty area after each file
+    uint32_t seed        = 1;
+};
+
+// Writes a freshly initialized volume holding `spec.files` permanent files
+// with pseudo-random contents.  Segments are filled to two entries short of
+// capacity so /copyto has room to insert without splitting at once.
+void generateImage(const std::string& path, const ImageSpec& spec)
+{
+    if (spec.segments < 1 || spec.segments > 31) {
+        throw std::runtime_error("Segment count must be 1..31");
+    }
+    if (spec.extraBytes % 2 != 0) {
+        throw std::runtime_error("Extra bytes per entry must be even");
+    }
+    if (spec.minBlocks < 1 || spec.maxBlocks < spec.minBlocks) {
+        throw std::runtime_error("Invalid file size range");
+    }
+
+    const uint32_t firstDirBlock = 6;
+    const uint32_t dataStart  = firstDirBlock + spec.segments * DIR_SEGMENT_BLOCKS;
+    const uint16_t entryWords = static_cast<uint16_t>(7 + spec.extraBytes / 2);
+    if (5 + 3 * entryWords > 512) throw std::runtime_error("Extra bytes per entry too large");
+    const uint16_t perSegment = static_cast<uint16_t>((512 - 5) / entryWords - 3);
+
+    if (spec.totalBlocks > 0xFFFF || spec.totalBlocks <= dataStart) {
+        throw std::runtime_error("Volume size must leave room for data and fit in 65535 blocks");
+    }
+
+    std::mt19937 rng(spec.seed);
+    auto fileSize = [&]() -> uint32_t {
+        if (spec.logSizes) {
+            std::uniform_real_distribution<double> d(std::log(static_cast<double>(spec.minBlocks)),
+                                                     std::log(spec.maxBlocks + 1.0));
+            return std::min(spec.maxBlocks, static_cast<uint32_t>(std::exp(d(rng))));
+        }
+        return std::uniform_int_distribution<uint32_t>(spec.minBlocks, spec.maxBlocks)(rng);
+    };
+    std::bernoulli_distribution hole(spec.fragmentation);
+
+    // Directory entries in address order: {status, rad50 x3, length}
+    struct GenEntry { uint16_t status; uint16_t rad50[3]; uint32_t length; };
+    std::vector<GenEntry> list;
+    uint32_t cursor = dataStart;
+    for (uint32_t i = 0; i < spec.files; ++i) {
+        uint32_t len = fileSize();
+        if (cursor + len > spec.totalBlocks) {
+            throw std::runtime_error("Volume too small for " + std::to_string(spec.files) + " files");
+        }
+        GenEntry e{E_PERM, {0, 0, 0}, len};
+        std::ostringstream name;
+        name << "F" << std::setw(5) << std::setfill('0') << i << ".DAT";
+        encodeFileName(name.str(), e.rad50[0], e.rad50[1], e.rad50[2]);
+        list.push_back(e);
+        cursor += len;
+
+        if (hole(rng)) {
+            uint32_t gap = std::min(fileSize(), spec.totalBlocks - cursor);
+            if (gap > 0) {
+                list.push_back({E_MPTY, {0, 0, 0}, gap});
+                cursor += gap;
+            }
+        }
+    }
+    if (cursor < spec.totalBlocks) {
+        // One length word cannot describe more than 65535 blocks, but the
+        // volume size is limited to that anyway.
+        list.push_back({E_MPTY, {0, 0, 0}, spec.totalBlocks - cursor});
+    }
+
+    size_t segsNeeded = std::max<size_t>(1, (list.size() + perSegment - 1) / perSegment);
+    if (segsNeeded > spec.segments) {
+        throw std::runtime_error("Directory needs " + std::to_string(segsNeeded) +
+                                 " segments; raise /segments or lower /files");
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot create image: " + path);
+
+    // Blocks 0..dataStart-1: boot, home and directory
+    std::vector<uint8_t> head(static_cast<size_t>(dataStart) * BLOCK_SIZE, 0);
+    uint16_t home[256] = {};
+    home[233] = 1;              // pack cluster size
+    home[234] = firstDirBlock;  // first directory block
+    home[HOME_CHECKSUM_WORD] = homeBlockChecksum(home);
+    packWords(home, head.data() + BLOCK_SIZE, 256);
+
+    size_t next = 0;
+    uint32_t segStart = dataStart;
+    for (uint16_t s = 1; s <= segsNeeded; ++s) {
+        std::array<uint16_t, 512> w{};
+        w[0] = spec.segments;
+        w[1] = (s < segsNeeded) ? static_cast<uint16_t>(s + 1) : 0;
+        w[2] = (s == 1) ? static_cast<uint16_t>(segsNeeded) : 0;
+        w[3] = spec.extraBytes;
+        w[4] = static_cast<uint16_t>(segStart);
+
+        uint16_t idx = 5;
+        for (uint16_t k = 0; k < perSegment && next < list.size(); ++k, ++next) {
+            const GenEntry& e = list[next];
+            w[idx + 0] = e.status;
+            w[idx + 1] = e.rad50[0];
+            w[idx + 2] = e.rad50[1];
+            w[idx + 3] = e.rad50[2];
+            w[idx + 4] = static_cast<uint16_t>(e.length);
+            w[idx + 6] = (e.status & E_PERM) ? BENCH_DATE : 0;
+            segStart += e.length;
+            idx = static_cast<uint16_t>(idx + entryWords);
+        }
+        w[idx] = E_EOS;
+        packWords(w.data(), head.data() + (firstDirBlock + (s - 1) * DIR_SEGMENT_BLOCKS) * BLOCK_SIZE,
+                  512);
+    }
+    out.write(reinterpret_cast<const char*>(head.data()), static_cast<std::streamsize>(head.size()));
+
+    // Data area, in chunks; empty areas are zero
+    std::vector<uint8_t> chunk(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+    for (const auto& e : list) {
+        uint32_t left = e.length;
+        while (left > 0) {
+            uint32_t n = std::min(left, COPY_CHUNK_BLOCKS);
+            size_t bytes = static_cast<size_t>(n) * BLOCK_SIZE;
+            if (e.status & E_PERM) {
+                for (size_t i = 0; i < bytes; i += 4) {
+                    uint32_t r = rng();
+                    std::memcpy(chunk.data() + i, &r, 4);
+                }
+            } else {
+                std::memset(chunk.data(), 0, bytes);
+            }
+            out.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(bytes));
+            left -= n;
+        }
+    }
+
+    if (!out) throw std::runtime_error("Failed to write image: " + path);
+}
+
+// ------------------------------
+// Process I/O counters
+// ------------------------------
+// Read/write calls and page faults of the whole process, so worker threads
+// and memory-mapped access are included.  Counters that the platform does
+// not provide stay zero.
+struct IoCounters {
+    uint64_t readCalls  = 0;
+    uint64_t writeCalls = 0;
+    uint64_t faults     = 0;
+};
+
+IoCounters sampleIoCounters()
+{
+    IoCounters c;
+#ifdef _WIN32
+    IO_COUNTERS io;
+    if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+        c.readCalls  = io.ReadOperationCount;
+        c.writeCalls = io.WriteOperationCount;
+    }
+#else
+#ifdef __linux__
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:") c.readCalls = value;
+        else if (key == "syscw:") c.writeCalls = value;
+    }
+#endif
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        c.faults = static_cast<uint64_t>(ru.ru_minflt) + static_cast<uint64_t>(ru.ru_majflt);
+    }
+#endif
+    return c;
+}
+
+// What taking a sample itself adds (reading /proc/self/io is I/O too),
+// measured once and subtracted from every suite.
+IoCounters samplingCost()
+{
+    static const IoCounters cost = [] {
+        IoCounters a = sampleIoCounters();
+        IoCounters b = sampleIoCounters();
+        return IoCounters{b.readCalls - a.readCalls, b.writeCalls - a.writeCalls, 0};
+    }();
+    return cost;
+}
+
+// ------------------------------
+// Timing suites
+// ------------------------------
+struct BenchResult {
+    std::string suite;
+    uint64_t files  = 0;      // per iteration
+    uint64_t blocks = 0;      // per iteration
+    std::vector<double> seconds;
+    IoCounters io;            // summed over all iterations
+};
+
+// Swallows the tool's console output while a suite runs.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+class QuietCout {
+public:
+    QuietCout() : saved_(std::cout.rdbuf(&null_)) {}
+    ~QuietCout() { std::cout.rdbuf(saved_); }
+private:
+    NullBuffer null_;
+    std::streambuf* saved_;
+};
+
+// Runs `body` `iterations` times after calling `setup` (untimed) before each.
+template <typename Setup, typename Body>
+void timeSuite(BenchResult& r, unsigned iterations, Setup setup, Body body)
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        setup();
+        IoCounters before = sampleIoCounters();
+        auto t0 = std::chrono::steady_clock::now();
+        {
+            QuietCout quiet;
+            body();
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        IoCounters after = sampleIoCounters();
+
+        r.seconds.push_back(std::chrono::duration<double>(t1 - t0).count());
+        IoCounters cost = samplingCost();
+        auto delta = [](uint64_t a, uint64_t b, uint64_t overhead) {
+            return (a - b > overhead) ? a - b - overhead : 0;
+        };
+        r.io.readCalls  += delta(after.readCalls, before.readCalls, cost.readCalls);
+        r.io.writeCalls += delta(after.writeCalls, before.writeCalls, cost.writeCalls);
+        r.io.faults     += delta(after.faults, before.faults, cost.faults);
+    }
+}
+
+void printResultHeader()
+{
+    std::cout << std::left << std::setw(14) << "suite" << std::right
+              << std::setw(8)  << "files"
+              << std::setw(10) << "blocks"
+              << std::setw(11) << "best ms"
+              << std::setw(11) << "median ms"
+              << std::setw(12) << "files/s"
+              << std::setw(13) << "blocks/s"
+              << std::setw(10) << "reads"
+              << std::setw(10) << "writes"
+              << std::setw(10) << "faults" << "\n";
+}
+
+void printResult(const BenchResult& r)
+{
+    std::vector<double> s = r.seconds;
+    std::sort(s.begin(), s.end());
+    double best   = s.front();
+    double median = s[s.size() / 2];
+    double n      = static_cast<double>(s.size());
+
+    std::cout << std::left << std::setw(14) << r.suite << std::right
+              << std::setw(8)  << r.files
+              << std::setw(10) << r.blocks
+              << std::fixed << std::setprecision(2)
+              << std::setw(11) << best * 1000.0
+              << std::setw(11) << median * 1000.0
+              << std::setprecision(0)
+              << std::setw(12) << (best > 0 ? r.files / best : 0.0)
+              << std::setw(13) << (best > 0 ? r.blocks / best : 0.0)
+              << std::defaultfloat
+              // per iteration
+              << std::setw(10) << static_cast<uint64_t>(r.io.readCalls / n)
+              << std::setw(10) << static_cast<uint64_t>(r.io.writeCalls / n)
+              << std::setw(10) << static_cast<uint64_t>(r.io.faults / n) << "\n";
+}
+
+// ------------------------------
+// Help
+// ------------------------------
+void printBenchHelp() {
+    std::cout
+        << "RT-11 Disk Utility benchmark (rt11bench)\n\n"
+        << "Usage:\n"
+        << "  rt11bench [options]\n"
+        << "      Generates a synthetic RT-11 image in the work folder and times the\n"
+        << "      directory and copy paths against it.\n\n"
+        << "Image generator:\n"
+        << "  /blocks:N          Volume size in blocks (default 65535, max 65535)\n"
+        << "  /segments:N        Directory segments, 1..31 (default 31)\n"
+        << "  /extra:N           Extra bytes per directory entry (default 0)\n"
+        << "  /files:N           Number of files (default 1000)\n"
+        << "  /sizes:MIN-MAX     File size range in blocks (default 1-40)\n"
+        << "  /dist:uniform|log  File size distribution (default uniform)\n"
+        << "  /frag:P            Chance (0..1) of an empty area after each file (default 0)\n"
+        << "  /seed:N            Random seed (default 1)\n"
+        << "  /image:path        Benchmark an existing image instead (never modified)\n\n"
+        << "Timing:\n"
+        << "  /suite:a,b,...     Suites to run: readdir, names, list, copyfrom, copyto\n"
+        << "                     (default all)\n"
+        << "  /iter:N            Iterations per suite (default 5)\n"
+        << "  /jobs:N            Threads for copyfrom (default 1, 0 = one per CPU)\n"
+        << "  /io:sync|uring     How copyfrom and copyto move file data (default sync)\n"
+        << "  /work:folder       Work folder (default <temp>/rt11bench)\n"
+        << "  /keep              Leave the generated images and extracted files\n\n"
+        << "Output is one line per suite: best and median wall time, files/s and\n"
+        << "blocks/s from the best run, and read calls, write calls and page faults\n"
+        << "per iteration for the whole process (where the platform reports them).\n";
+}
+
+// ------------------------------
+// Main
+// ------------------------------
+int main(int argc, char* argv[]) {
+    try {
+        ImageSpec spec;
+        std::string imagePath;
+        std::string suites = "readdir,names,list,copyfrom,copyto";
+        unsigned iterations = 5;
+        unsigned jobs = 1;
+        bool asyncIo = false;
+        bool keep = false;
+        std::filesystem::path work = std::filesystem::temp_directory_path() / "rt11bench";
+
+        auto number = [](const std::string& arg, size_t skip) -> unsigned long {
+            try {
+                return std::stoul(arg.substr(skip));
+            } catch (const std::exception&) {
+                throw std::runtime_error("Invalid number in " + arg);
+            }
+        };
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+
+            if (arg == "/help" || arg == "/h" || arg == "/?") {
+                printBenchHelp();
+                return 0;
+            } else if (arg.rfind("/blocks:", 0) == 0) {
+                spec.totalBlocks = static_cast<uint32_t>(number(arg, 8));
+            } else if (arg.rfind("/segments:", 0) == 0) {
+                spec.segments = static_cast<uint16_t>(number(arg, 10));
+            } else if (arg.rfind("/extra:", 0) == 0) {
+                spec.extraBytes = static_cast<uint16_t>(number(arg, 7));
+            } else if (arg.rfind("/files:", 0) == 0) {
+                spec.files = static_cast<uint32_t>(number(arg, 7));
+            } else if (arg.rfind("/sizes:", 0) == 0) {
+                std::string range = arg.substr(7);
+                auto dash = range.find('-');
+                if (dash == std::string::npos) throw std::runtime_error("Expected /sizes:MIN-MAX");
+                spec.minBlocks = static_cast<uint32_t>(number(range.substr(0, dash), 0));
+                spec.maxBlocks = static_cast<uint32_t>(number(range, dash + 1));
+            } else if (arg == "/dist:uniform") {
+                spec.logSizes = false;
+            } else if (arg == "/dist:log") {
+                spec.logSizes = true;
+            } else if (arg.rfind("/frag:", 0) == 0) {
+                spec.fragmentation = std::stod(arg.substr(6));
+                if (spec.fragmentation < 0.0 || spec.fragmentation > 1.0) {
+                    throw std::runtime_error("/frag must be between 0 and 1");
+                }
+            } else if (arg.rfind("/seed:", 0) == 0) {
+                spec.seed = static_cast<uint32_t>(number(arg, 6));
+            } else if (arg.rfind("/image:", 0) == 0) {
+                imagePath = arg.substr(7);
+            } else if (arg.rfind("/suite:", 0) == 0) {
+                suites = arg.substr(7);
+            } else if (arg.rfind("/iter:", 0) == 0) {
+                iterations = std::max(1u, static_cast<unsigned>(number(arg, 6)));
+            } else if (arg.rfind("/jobs:", 0) == 0) {
+                jobs = static_cast<unsigned>(number(arg, 6));
+                if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+            } else if (arg == "/io:uring" || arg == "/io:sync") {
+                asyncIo = arg == "/io:uring";
+            } else if (arg.rfind("/work:", 0) == 0) {
+                work = arg.substr(6);
+            } else if (arg == "/keep") {
+                keep = true;
+            } else {
+                std::cerr << "Unknown option: " << arg << "\n";
+                return 1;
+            }
+        }
+
+        auto wanted = [&](const std::string& name) {
+            std::stringstream ss(suites);
+            std::string s;
+            while (std::getline(ss, s, ',')) {
+                if (s == name) return true;
+            }
+            return false;
+        };
+
+        std::filesystem::create_directories(work);
+        const std::filesystem::path outDir  = work / "out";
+        const std::filesystem::path scratch = work / "copyto.dsk";
+
+        bool generated = imagePath.empty();
+        if (generated) {
+            imagePath = (work / "bench.dsk").string();
+            auto t0 = std::chrono::steady_clock::now();
+            generateImage(imagePath, spec);
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::cout << "Generated " << imagePath << ": " << spec.totalBlocks << " blocks, "
+                      << spec.segments << " segments, " << spec.files << " files in "
+                      << std::fixed << std::setprecision(2) << secs * 1000.0
+                      << std::defaultfloat << " ms\n";
+        }
+
+        // Workload of the image under test
+        uint64_t files = 0, blocks = 0, dirBlocks = 0;
+        {
+            BlockDevice dev(imagePath, false);
+            BlockCache cache(dev);
+            std::vector<Rt11Entry> entries;
+            readDirectory(cache, entries);
+            for (const auto& e : entries) {
+                if (e.permanent()) {
+                    ++files;
+                    blocks += e.lengthBlocks;
+                }
+            }
+            dirBlocks = cache.misses();
+        }
+
+        std::vector<BenchResult> results;
+        auto none = []() {};
+
+        if (wanted("readdir")) {
+            BenchResult r{"readdir", files, dirBlocks, {}, {}};
+            timeSuite(r, iterations, none, [&]() {
+                BlockDevice dev(imagePath, false);
+                BlockCache cache(dev);
+                std::vector<Rt11Entry> entries;
+                readDirectory(cache, entries);
+            });
+            results.push_back(r);
+        }
+
+        if (wanted("names")) {
+            // Name decoding alone, over the whole directory
+            BlockDevice dev(imagePath, false);
+            BlockCache cache(dev);
+            std::vector<Rt11Entry> entries;
+            readDirectory(cache, entries);
+            std::vector<std::string> names;
+
+            BenchResult r{"names", entries.size(), 0, {}, {}};
+            timeSuite(r, iterations, none, [&]() { decodeFileNames(entries, names); });
+            results.push_back(r);
+        }
+
+        if (wanted("list")) {
+            BenchResult r{"list", files, dirBlocks, {}, {}};
+            timeSuite(r, iterations, none, [&]() {
+                BlockDevice dev(imagePath, false);
+                BlockCache cache(dev);
+                showDirectory(cache, imagePath, false, true);
+            });
+            results.push_back(r);
+        }
+
+        bool haveExtracted = false;
+        if (wanted("copyfrom") || wanted("copyto")) {
+            BenchResult r{"copyfrom", files, blocks, {}, {}};
+            if (asyncIo)       r.suite += "/uring";
+            else if (jobs > 1) r.suite += "/j" + std::to_string(jobs);
+            auto clearOut = [&]() {
+                std::filesystem::remove_all(outDir);
+                std::filesystem::create_directories(outDir);
+            };
+            timeSuite(r, wanted("copyfrom") ? iterations : 1, clearOut, [&]() {
+                BlockDevice dev(imagePath, false);
+                BlockCache cache(dev);
+                copyFromRt11(cache, imagePath, Rt11PatternSet(), outDir.string(), false, jobs, false, asyncIo);
+            });
+            if (wanted("copyfrom")) results.push_back(r);
+            haveExtracted = true;
+        }
+
+        if (wanted("copyto") && haveExtracted) {
+            // Copies the extracted files back onto an empty volume of the
+            // same size and entry layout.  It gets the full 31 segments, since
+            // splitting leaves segments half full as they fill up.
+            ImageSpec blank = spec;
+            blank.files = 0;
+            blank.fragmentation = 0.0;
+            {
+                BlockDevice dev(imagePath, false);
+                BlockCache cache(dev);
+                DirectoryImage dir;
+                loadDirectoryImage(cache, dir);
+                DirSegmentHeader hdr = parseSegmentHeader(dir.words(1));
+                blank.totalBlocks = std::min<uint32_t>(cache.totalBlocks(), 0xFFFF);
+                blank.segments    = 31;
+                blank.extraBytes  = hdr.extraBytes;
+            }
+            BenchResult r{"copyto", files, blocks, {}, {}};
+            if (asyncIo) r.suite += "/uring";
+            try {
+                timeSuite(r, iterations,
+                          [&]() { generateImage(scratch.string(), blank); },
+                          [&]() {
+                              BlockDevice dev(scratch.string(), true);
+                              BlockCache cache(dev);
+                              copyToRt11(cache, scratch.string(), (outDir / "*.*").string(), false, BENCH_DATE,
+                                         AllocPolicy::FirstFit, false, std::cout, asyncIo);
+                          });
+                results.push_back(r);
+            } catch (const std::exception& ex) {
+                // Typically the directory filling up on a large file count
+                std::cerr << "copyto suite skipped: " << ex.what() << "\n";
+            }
+        }
+
+        printResultHeader();
+        for (const auto& r : results) printResult(r);
+
+        if (!keep) {
+            std::filesystem::remove_all(outDir);
+            std::filesystem::remove(scratch);
+            if (generated) std::filesystem::remove(imagePath);
+        }
+        return 0;
+    }
+    catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,3910 @@
+#include "rt11engine.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <list>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) || defined(__FreeBSD__)
+#define RT11_HAVE_PREADV 1      // elsewhere each buffer is its own pread/pwrite
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE               // <linux/fs.h> defines it as 1024 over ours
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define RT11_HAVE_IO_URING 1    // raw system calls; liburing is not needed
+#endif
+#endif
+#endif
+
+// ------------------------------
+// Block device
+// ------------------------------
+static const char OVERLAY_MAGIC[8] = {'R', '1', '1', 'O', 'V', 'L', '0', '1'};
+static const size_t OVERLAY_HEADER = BLOCK_SIZE;
+static const size_t OVERLAY_RECORD = 4 + BLOCK_SIZE;   // block number, data
+
+struct BlockDevice::Overlay {
+    std::string path;
+    std::fstream file;     // not open for a read-only device without a delta
+    std::unordered_map<uint32_t, uint64_t> records;   // block -> offset of its data
+    uint64_t end = OVERLAY_HEADER;
+    std::mutex m;          // guards file
+};
+
+#ifndef _WIN32
+// Moves every byte described by `iov` at `offset`, resuming after short
+// transfers.
+void transferAll(int fd, iovec* iov, int n, off_t offset, bool write)
+{
+    while (n > 0) {
+#ifdef RT11_HAVE_PREADV
+        ssize_t r = write ? ::pwritev(fd, iov, n, offset)
+                          : ::preadv(fd, iov, n, offset);
+#else
+        ssize_t r = write ? ::pwrite(fd, iov->iov_base, iov->iov_len, offset)
+                          : ::pread(fd, iov->iov_base, iov->iov_len, offset);
+#endif
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            throw Rt11Error(rt11::Error::Io, std::string(write ? "Failed to write block " : "Failed to read block ") +
+                                             std::to_string(offset / static_cast<off_t>(BLOCK_SIZE)));
+        }
+
+        offset += r;
+        size_t left = static_cast<size_t>(r);
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
+
+// Spans of consecutive blocks from `block` on, in batches of up to 64
+// buffers per preadv/pwritev.
+void transferSpans(int fd, const BlockDevice::Span* spans, size_t n, uint32_t block, bool write)
+{
+    iovec iov[64];
+    off_t offset = static_cast<off_t>(block) * static_cast<off_t>(BLOCK_SIZE);
+    while (n > 0) {
+        int batch = static_cast<int>(std::min<size_t>(n, 64));
+        off_t bytes = 0;
+        for (int i = 0; i < batch; ++i) {
+            iov[i].iov_base = spans[i].data;
+            iov[i].iov_len  = static_cast<size_t>(spans[i].count) * BLOCK_SIZE;
+            bytes += static_cast<off_t>(iov[i].iov_len);
+        }
+        transferAll(fd, iov, batch, offset, write);
+        offset += bytes;
+        spans  += batch;
+        n      -= static_cast<size_t>(batch);
+    }
+}
+#endif
+
+BlockDevice::BlockDevice(const std::string& path, bool writable, const std::string& overlayPath)
+    : path_(path), writable_(writable && overlayPath.empty())
+{
+    if (!openDescriptor()) openStream();
+    try {
+        recoverJournal();
+        if (!overlayPath.empty()) {
+            openOverlay(overlayPath, writable);
+            recoverJournal();
+        }
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+BlockDevice::~BlockDevice() {
+    release();
+}
+
+// Regular files are mapped, other seekable files (block devices) used
+// through pread/pwrite.  False leaves the image to openStream().
+bool BlockDevice::openDescriptor() {
+#ifndef _WIN32
+    int fd = ::open(path_.c_str(), writable_ ? O_RDWR : O_RDONLY);
+    if (fd >= 0) {
+        // Regular files report their size; block devices only to lseek.
+        // Pipes fail both and are read into memory by openStream().
+        struct stat st{};
+        bool regular = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        off_t size = regular ? st.st_size : ::lseek(fd, 0, SEEK_END);
+        if (size >= static_cast<off_t>(BLOCK_SIZE)) {
+            fd_          = fd;
+            totalBlocks_ = static_cast<uint32_t>(size / static_cast<off_t>(BLOCK_SIZE));
+            journaled_   = writable_ && regular;
+            if (regular) {
+                int prot = writable_ ? (PROT_READ | PROT_WRITE) : PROT_READ;
+                void* p = ::mmap(nullptr, static_cast<size_t>(size), prot, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) {
+                    map_     = static_cast<uint8_t*>(p);
+                    mapSize_ = static_cast<size_t>(size);
+                    base_    = map_;
+                }
+            }
+            return true;
+        }
+        ::close(fd);
+    }
+#endif
+    return false;
+}
+
+void BlockDevice::release() {
+    unlockJournal();
+#ifndef _WIN32
+    if (map_) ::munmap(map_, mapSize_);
+    if (fd_ >= 0) ::close(fd_);
+    map_ = nullptr;
+    fd_  = -1;
+#endif
+}
+
+void BlockDevice::openStream() {
+    auto mode = std::ios::binary | std::ios::in;
+    if (writable_) mode |= std::ios::out;
+    stream_.open(path_, mode);
+    if (!stream_) {
+        throw Rt11Error(rt11::Error::OpenFailed, writable_ ? "Cannot open disk image (read/write)"
+                                                           : "Cannot open disk image");
+    }
+
+    stream_.seekg(0, std::ios::end);
+    auto size = stream_.tellg();
+    if (size < 0) {
+        // Not seekable (pipe or similar): pull the whole image into memory.
+        if (writable_) throw Rt11Error(rt11::Error::ReadOnly, "Cannot write to a non-seekable disk image");
+        stream_.clear();
+        std::vector<char> chunk(64 * 1024);
+        while (stream_.read(chunk.data(), chunk.size()) || stream_.gcount() > 0) {
+            memory_.insert(memory_.end(), chunk.data(), chunk.data() + stream_.gcount());
+        }
+        stream_.close();
+        base_ = memory_.data();
+        totalBlocks_ = static_cast<uint32_t>(memory_.size() / BLOCK_SIZE);
+    } else {
+        totalBlocks_ = static_cast<uint32_t>(size / BLOCK_SIZE);
+        journaled_   = writable_;
+    }
+
+    if (totalBlocks_ == 0) throw Rt11Error(rt11::Error::OpenFailed, "Disk image is empty or invalid size");
+}
+
+void BlockDevice::checkRange(uint32_t block, uint32_t count, const char* op) const {
+    if (count == 0 || block >= totalBlocks_ || count > totalBlocks_ - block) {
+        throw Rt11Error(rt11::Error::Io, std::string("Failed to ") + op + " block " +
+                                         std::to_string(block) + " (beyond end of image)");
+    }
+}
+
+const uint8_t* BlockDevice::blocks(uint32_t block, uint32_t count) {
+    checkRange(block, count, "read");
+    if (inMemory()) return base_ + static_cast<size_t>(block) * BLOCK_SIZE;
+
+    buf_.resize(static_cast<size_t>(count) * BLOCK_SIZE);
+    readAt(block, count, buf_.data());
+    return buf_.data();
+}
+
+const uint8_t* BlockDevice::view(uint32_t block, uint32_t count) const {
+    checkRange(block, count, "read");
+    if (!inMemory()) throw std::runtime_error("Disk image is not in memory");
+    return base_ + static_cast<size_t>(block) * BLOCK_SIZE;
+}
+
+void BlockDevice::readAt(uint32_t block, uint32_t count, uint8_t* out) const {
+    Span span{out, count};
+    readSpans(block, &span, 1);
+}
+
+void BlockDevice::readSpans(uint32_t block, const Span* spans, size_t n) const {
+    uint32_t count = 0;
+    for (size_t i = 0; i < n; ++i) count += spans[i].count;
+    checkRange(block, count, "read");
+
+    if (overlay_) overlayTransfer(block, spans, n, false);
+    else          readImage(block, spans, n);
+}
+
+// The image itself, without the overlay
+void BlockDevice::readImage(uint32_t block, const Span* spans, size_t n) const {
+    if (base_) {
+        const uint8_t* src = base_ + static_cast<size_t>(block) * BLOCK_SIZE;
+        for (size_t i = 0; i < n; ++i) {
+            size_t bytes = static_cast<size_t>(spans[i].count) * BLOCK_SIZE;
+            std::memcpy(spans[i].data, src, bytes);
+            src += bytes;
+        }
+        return;
+    }
+
+#ifndef _WIN32
+    if (fd_ >= 0) {
+        transferSpans(fd_, spans, n, block, false);
+        return;
+    }
+#endif
+
+    streamTransfer(block, spans, n, false);
+}
+
+void BlockDevice::writeBlocks(uint32_t block, const uint8_t* data, uint32_t count) {
+    Span span{const_cast<uint8_t*>(data), count};
+    writeSpans(block, &span, 1);
+}
+
+void BlockDevice::writeSpans(uint32_t block, const Span* spans, size_t n) {
+    if (!writable_) throw Rt11Error(rt11::Error::ReadOnly, "Disk image is not open for writing");
+    uint32_t count = 0;
+    for (size_t i = 0; i < n; ++i) count += spans[i].count;
+    checkRange(block, count, "write");
+
+    if (overlay_) {
+        overlayTransfer(block, spans, n, true);
+        return;
+    }
+
+    if (map_) {
+        uint8_t* dst = map_ + static_cast<size_t>(block) * BLOCK_SIZE;
+        for (size_t i = 0; i < n; ++i) {
+            size_t bytes = static_cast<size_t>(spans[i].count) * BLOCK_SIZE;
+            std::memcpy(dst, spans[i].data, bytes);
+            dst += bytes;
+        }
+        return;
+    }
+
+#ifndef _WIN32
+    if (fd_ >= 0) {
+        transferSpans(fd_, spans, n, block, true);
+        return;
+    }
+#endif
+
+    streamTransfer(block, spans, n, true);
+}
+
+// The stream has one position for reading and writing, so every transfer
+// holds the lock from the seek to the last byte.
+void BlockDevice::streamTransfer(uint32_t block, const Span* spans, size_t n, bool write) const {
+    std::lock_guard<std::mutex> lock(streamMutex_);
+    if (write) stream_.seekp(static_cast<std::streamoff>(block) * BLOCK_SIZE, std::ios::beg);
+    else       stream_.seekg(static_cast<std::streamoff>(block) * BLOCK_SIZE, std::ios::beg);
+    if (!stream_.good()) {
+        throw Rt11Error(rt11::Error::Io, std::string(write ? "Failed to seek (write) to block "
+                                                           : "Failed to seek to block ") + std::to_string(block));
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        auto bytes = static_cast<std::streamsize>(spans[i].count) * BLOCK_SIZE;
+        if (write) stream_.write(reinterpret_cast<const char*>(spans[i].data), bytes);
+        else       stream_.read(reinterpret_cast<char*>(spans[i].data), bytes);
+        if (!stream_.good()) {
+            throw Rt11Error(rt11::Error::Io, std::string(write ? "Failed to write block "
+                                                               : "Failed to read block ") + std::to_string(block));
+        }
+        block += spans[i].count;
+    }
+}
+
+void BlockDevice::flush() {
+    if (overlay_) {
+        std::lock_guard<std::mutex> lock(overlay_->m);
+        if (overlay_->file.is_open() && !overlay_->file.flush()) {
+            throw Rt11Error(rt11::Error::Io, "Failed to flush overlay: " + overlay_->path);
+        }
+        return;
+    }
+
+    // Mapped and pwrite() writes are already in the page cache; only the
+    // stream buffers.
+    if (!map_ && stream_.is_open()) {
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        stream_.flush();
+        if (!stream_.good()) throw Rt11Error(rt11::Error::Io, "Failed to flush disk image");
+    }
+}
+
+void BlockDevice::sync() {
+    flush();
+#ifndef _WIN32
+    if (overlay_) {
+        // Any descriptor of the file will do for fsync
+        int fd = ::open(overlay_->path.c_str(), O_RDONLY);
+        bool ok = fd >= 0 && ::fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        if (!ok) throw Rt11Error(rt11::Error::Io, "Failed to sync overlay: " + overlay_->path);
+        return;
+    }
+    if ((map_ && ::msync(map_, mapSize_, MS_SYNC) != 0) || (fd_ >= 0 && ::fsync(fd_) != 0)) {
+        throw Rt11Error(rt11::Error::Io, std::string("Failed to sync disk image: ") + std::strerror(errno));
+    }
+#endif
+}
+
+std::string BlockDevice::journalPath() const {
+    return (overlay_ ? overlay_->path : path_) + ".r11j";
+}
+
+// The lock is taken on a descriptor of its own, so it works for images
+// reached through the stream and for overlays alike; closing it releases
+// the lock.
+bool BlockDevice::lockJournal(bool wait) {
+    const std::string& target = overlay_ ? overlay_->path : path_;
+#ifndef _WIN32
+    if (lockFd_ < 0) {
+        lockFd_ = ::open(target.c_str(), O_RDONLY);
+        if (lockFd_ < 0) {
+            throw Rt11Error(rt11::Error::Io, "Cannot lock " + target + ": " + std::strerror(errno));
+        }
+    }
+    while (::flock(lockFd_, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+        if (errno == EINTR) continue;
+        int err = errno;
+        unlockJournal();
+        if (err == EWOULDBLOCK && !wait) return false;
+        throw Rt11Error(rt11::Error::Io, "Cannot lock " + target + ": " + std::strerror(err));
+    }
+#else
+    if (!lockHandle_) {
+        HANDLE h = ::CreateFileA(target.c_str(), GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) throw Rt11Error(rt11::Error::Io, "Cannot lock " + target);
+        lockHandle_ = h;
+    }
+    // Windows locks are mandatory; one byte far past the end of any image
+    // keeps the lock from blocking reads and writes of the image itself.
+    OVERLAPPED ov{};
+    ov.OffsetHigh = 0x80000000u;
+    DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+    if (!::LockFileEx(static_cast<HANDLE>(lockHandle_), flags, 0, 1, 0, &ov)) {
+        DWORD err = ::GetLastError();
+        ::CloseHandle(static_cast<HANDLE>(lockHandle_));
+        lockHandle_ = nullptr;
+        if (err == ERROR_LOCK_VIOLATION && !wait) return false;
+        throw Rt11Error(rt11::Error::Io, "Cannot lock " + target);
+    }
+#endif
+    return true;
+}
+
+void BlockDevice::unlockJournal() {
+#ifndef _WIN32
+    if (lockFd_ >= 0) ::close(lockFd_);
+    lockFd_ = -1;
+#else
+    if (lockHandle_) {
+        OVERLAPPED ov{};
+        ov.OffsetHigh = 0x80000000u;
+        ::UnlockFileEx(static_cast<HANDLE>(lockHandle_), 0, 1, 0, &ov);
+        ::CloseHandle(static_cast<HANDLE>(lockHandle_));
+    }
+    lockHandle_ = nullptr;
+#endif
+}
+
+void BlockDevice::openOverlay(const std::string& overlayPath, bool writable) {
+    auto ov = std::make_unique<Overlay>();
+    ov->path = overlayPath;
+    const uint64_t imageBytes = static_cast<uint64_t>(totalBlocks_) * BLOCK_SIZE;
+
+    std::error_code ec;
+    bool exists = std::filesystem::exists(overlayPath, ec);
+    if (!exists && writable) {
+        uint8_t header[OVERLAY_HEADER] = {};
+        std::memcpy(header, OVERLAY_MAGIC, 8);
+        putLE(header + 8, imageBytes, 8);
+        std::ofstream create(overlayPath, std::ios::binary | std::ios::trunc);
+        create.write(reinterpret_cast<const char*>(header), sizeof(header));
+        if (!create) throw Rt11Error(rt11::Error::OpenFailed, "Cannot create overlay: " + overlayPath);
+        exists = true;
+    }
+
+    if (exists) {
+        auto mode = std::ios::binary | std::ios::in;
+        if (writable) mode |= std::ios::out;
+        ov->file.open(overlayPath, mode);
+        if (!ov->file) throw Rt11Error(rt11::Error::OpenFailed, "Cannot open overlay: " + overlayPath);
+
+        uint8_t header[OVERLAY_HEADER];
+        if (!ov->file.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+            std::memcmp(header, OVERLAY_MAGIC, 8) != 0) {
+            throw Rt11Error(rt11::Error::OpenFailed, "Not an overlay file: " + overlayPath);
+        }
+        if (getLE(header + 8, 8) != imageBytes) {
+            throw Rt11Error(rt11::Error::OpenFailed, "Overlay " + overlayPath + " belongs to an image of another size");
+        }
+
+        // A record cut short by a crash is dropped and later overwritten
+        uint8_t rec[OVERLAY_RECORD];
+        while (ov->file.read(reinterpret_cast<char*>(rec), sizeof(rec))) {
+            uint32_t b = static_cast<uint32_t>(getLE(rec, 4));
+            if (b >= totalBlocks_) {
+                throw Rt11Error(rt11::Error::OpenFailed, "Overlay " + overlayPath + " is damaged");
+            }
+            ov->records[b] = ov->end + 4;
+            ov->end += OVERLAY_RECORD;
+        }
+        ov->file.clear();
+    }
+
+    overlay_   = std::move(ov);
+    writable_  = writable;
+    journaled_ = writable;
+}
+
+std::vector<uint32_t> BlockDevice::overlayBlocks() const {
+    std::vector<uint32_t> blocks;
+    if (overlay_) {
+        for (const auto& r : overlay_->records) blocks.push_back(r.first);
+        std::sort(blocks.begin(), blocks.end());
+    }
+    return blocks;
+}
+
+// Writes go to the block's record in the delta, or a new one at its end.
+// Reads take blocks the delta holds from there and each run of the others
+// from the image in one call.
+void BlockDevice::overlayTransfer(uint32_t block, const Span* spans, size_t n, bool write) const {
+    Overlay& ov = *overlay_;
+    std::lock_guard<std::mutex> lock(ov.m);
+
+    uint32_t runStart = 0;
+    uint32_t runCount = 0;
+    uint8_t* runData = nullptr;
+    auto readRun = [&]() {
+        if (runCount == 0) return;
+        Span run{runData, runCount};
+        readImage(runStart, &run, 1);
+        runCount = 0;
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+        for (uint32_t k = 0; k < spans[i].count; ++k, ++block) {
+            uint8_t* data = spans[i].data + static_cast<size_t>(k) * BLOCK_SIZE;
+            auto it = ov.records.find(block);
+
+            if (write) {
+                if (it != ov.records.end()) {
+                    ov.file.seekp(static_cast<std::streamoff>(it->second));
+                    ov.file.write(reinterpret_cast<const char*>(data), BLOCK_SIZE);
+                } else {
+                    uint8_t rec[OVERLAY_RECORD];
+                    putLE(rec, block, 4);
+                    std::memcpy(rec + 4, data, BLOCK_SIZE);
+                    ov.file.seekp(static_cast<std::streamoff>(ov.end));
+                    ov.file.write(reinterpret_cast<const char*>(rec), sizeof(rec));
+                    if (ov.file.good()) {
+                        ov.records[block] = ov.end + 4;
+                        ov.end += OVERLAY_RECORD;
+                    }
+                }
+                if (!ov.file.good()) {
+                    throw Rt11Error(rt11::Error::Io, "Failed to write block " + std::to_string(block) +
+                                                     " to overlay " + ov.path);
+                }
+            } else if (it == ov.records.end()) {
+                if (runCount > 0 && runStart + runCount == block &&
+                    runData + static_cast<size_t>(runCount) * BLOCK_SIZE == data) {
+                    ++runCount;
+                } else {
+                    readRun();
+                    runStart = block;
+                    runData  = data;
+                    runCount = 1;
+                }
+            } else {
+                readRun();
+                ov.file.seekg(static_cast<std::streamoff>(it->second));
+                ov.file.read(reinterpret_cast<char*>(data), BLOCK_SIZE);
+                if (!ov.file.good()) {
+                    throw Rt11Error(rt11::Error::Io, "Failed to read block " + std::to_string(block) +
+                                                     " from overlay " + ov.path);
+                }
+            }
+        }
+    }
+    readRun();
+}
+
+// Releases a journal lock taken by lockJournal() when it goes out of scope.
+struct JournalUnlock {
+    BlockDevice* dev = nullptr;
+    ~JournalUnlock() { if (dev) dev->unlockJournal(); }
+};
+
+// Finishes a directory update whose journal was committed before a crash,
+// before anything reads the directory.  A read-only open has a writable
+// device of its own do the replay.  A journal that was never committed is
+// left for the next writable open to delete; the image is as it was.
+// While another process holds the journal lock its update is still in
+// flight, and the journal is left alone.
+void BlockDevice::recoverJournal() {
+    std::string jp = journalPath();
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(jp, ec)) return;
+
+    JournalUnlock unlock;
+    if (writable_) {
+        if (!lockJournal(false)) return;
+        unlock.dev = this;
+        if (!std::filesystem::is_regular_file(jp, ec)) return;   // finished meanwhile
+    }
+
+    std::vector<uint32_t> blocks;
+    std::vector<uint8_t> data;
+    bool committed = readJournal(jp, totalBlocks_, blocks, data);
+
+    if (!writable_) {
+        if (!committed) return;
+        try {
+            BlockDevice rw(path_, true, overlay_ ? overlay_->path : std::string());
+        } catch (const std::exception& ex) {
+            throw Rt11Error(rt11::Error::OpenFailed, "Disk image has an unfinished directory update in " + jp +
+                                                     "; open it for writing to complete it (" + ex.what() + ")");
+        }
+        return;
+    }
+
+    if (committed) {
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            writeBlocks(blocks[i], data.data() + i * BLOCK_SIZE);
+        }
+        sync();
+    }
+    std::filesystem::remove(jp, ec);
+}
+
+// ------------------------------
+// Block cache
+// ------------------------------
+BlockCache::BlockCache(BlockDevice& dev, size_t capacity)
+    : dev_(dev), capacity_(std::max<size_t>(capacity, DIR_SEGMENT_BLOCKS + 1))
+{
+}
+
+BlockCache::Slot& BlockCache::lookup(uint32_t block, bool load) {
+    auto it = index_.find(block);
+    if (it != index_.end()) {
+        ++hits_;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return lru_.front();
+    }
+
+    ++misses_;
+    if (lru_.size() >= capacity_ && !(lru_.back().dirty && dev_.journaled())) {
+        // Recycle the least recently used slot
+        Slot& victim = lru_.back();
+        if (victim.dirty) writeBack(victim);
+        index_.erase(victim.block);
+        lru_.splice(lru_.begin(), lru_, std::prev(lru_.end()));
+    } else {
+        lru_.emplace_front();
+    }
+
+    Slot& s = lru_.front();
+    s.block = block;
+    s.dirty = false;
+    if (load) {
+        try {
+            dev_.readAt(block, 1, s.data);
+        } catch (...) {
+            lru_.pop_front();
+            throw;
+        }
+    }
+    index_[block] = lru_.begin();
+    return s;
+}
+
+void BlockCache::writeBack(Slot& s) {
+    dev_.writeBlocks(s.block, s.data);
+    s.dirty = false;
+    ++writebacks_;
+}
+
+void BlockCache::writeBackRange(uint32_t block, uint32_t count) {
+    for (auto& s : lru_) {
+        if (s.dirty && s.block >= block && s.block - block < count) writeBack(s);
+    }
+}
+
+const uint8_t* BlockCache::read(uint32_t block) {
+    return lookup(block, true).data;
+}
+
+void BlockCache::write(uint32_t block, const uint8_t* data, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (block + i >= dev_.totalBlocks()) {
+            throw Rt11Error(rt11::Error::Io, "Failed to write block " + std::to_string(block + i) +
+                                             " (beyond end of image)");
+        }
+        Slot& s = lookup(block + i, false);
+        std::memcpy(s.data, data + static_cast<size_t>(i) * BLOCK_SIZE, BLOCK_SIZE);
+        s.dirty = true;
+    }
+}
+
+const uint8_t* BlockCache::readExtent(uint32_t block, uint32_t count) {
+    writeBackRange(block, count);
+    return dev_.blocks(block, count);
+}
+
+void BlockCache::writeExtent(uint32_t block, const uint8_t* data, uint32_t count) {
+    dev_.writeBlocks(block, data, count);
+
+    // Keep any cached copies in step with what is now on the image
+    for (auto& s : lru_) {
+        if (s.block >= block && s.block - block < count) {
+            std::memcpy(s.data, data + static_cast<size_t>(s.block - block) * BLOCK_SIZE, BLOCK_SIZE);
+            s.dirty = false;
+        }
+    }
+}
+
+void BlockCache::prefetch(uint32_t block, uint32_t count) {
+    if (count > capacity_ || block >= dev_.totalBlocks() || count > dev_.totalBlocks() - block) return;
+
+    // Each run of blocks not yet cached is read into fresh slots in one call
+    std::vector<BlockDevice::Span> spans;
+    uint32_t runStart = 0;
+    auto load = [&]() {
+        if (spans.empty()) return;
+        try {
+            dev_.readSpans(runStart, spans.data(), spans.size());
+        } catch (...) {
+            discardExtent(runStart, static_cast<uint32_t>(spans.size()));
+            throw;
+        }
+        spans.clear();
+    };
+    for (uint32_t b = block; b < block + count; ++b) {
+        if (index_.count(b)) {
+            load();
+            continue;
+        }
+        if (spans.empty()) runStart = b;
+        spans.push_back({lookup(b, false).data, 1});
+    }
+    load();
+}
+
+void BlockCache::discardExtent(uint32_t block, uint32_t count) {
+    for (auto it = lru_.begin(); it != lru_.end(); ) {
+        if (it->block >= block && it->block - block < count) {
+            index_.erase(it->block);
+            it = lru_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Dirty blocks go out in block order, each run of adjacent blocks in one
+// gathered write.  On a journaled device the file data written so far is
+// synced, the blocks are written to the journal and synced (the commit
+// point), written in place and synced, and the journal removed, all under
+// the device's journal lock.  A crash before the commit point leaves the
+// old directory; after it, the next open replays the journal and completes
+// the new one.
+void BlockCache::flush() {
+    std::vector<Slot*> dirty;
+    for (auto& s : lru_) {
+        if (s.dirty) dirty.push_back(&s);
+    }
+    std::sort(dirty.begin(), dirty.end(),
+              [](const Slot* a, const Slot* b) { return a->block < b->block; });
+
+    JournalUnlock unlock;
+    bool journal = !dirty.empty() && dev_.journaled();
+    if (journal) {
+        dev_.lockJournal(true);
+        unlock.dev = &dev_;
+        std::vector<uint32_t> blocks;
+        std::vector<const uint8_t*> data;
+        for (const auto* s : dirty) {
+            blocks.push_back(s->block);
+            data.push_back(s->data);
+        }
+        dev_.sync();
+        writeJournal(dev_.journalPath(), dev_.totalBlocks(), blocks, data);
+    }
+
+    std::vector<BlockDevice::Span> spans;
+    for (size_t i = 0; i < dirty.size(); ) {
+        size_t j = i;
+        spans.clear();
+        do {
+            spans.push_back({dirty[j]->data, 1});
+            ++j;
+        } while (j < dirty.size() && dirty[j]->block == dirty[j - 1]->block + 1);
+
+        dev_.writeSpans(dirty[i]->block, spans.data(), spans.size());
+        for (; i < j; ++i) {
+            dirty[i]->dirty = false;
+            ++writebacks_;
+        }
+    }
+    dev_.flush();
+
+    if (journal) {
+        dev_.sync();
+        std::error_code ec;
+        std::filesystem::remove(dev_.journalPath(), ec);
+    }
+}
+
+void printCacheStats(const BlockCache& cache, std::ostream& out) {
+    out << "Block cache: " << cache.hits() << " hits, "
+        << cache.misses() << " misses, "
+        << cache.writebacks() << " blocks written back\n";
+}
+
+// ------------------------------
+// Directory journal (<image>.r11j)
+// ------------------------------
+static const char JOURNAL_MAGIC[8] = {'R', '1', '1', 'J', 'R', 'N', 'L', '1'};
+static const size_t JOURNAL_HEADER  = 20;   // magic, image size, block count
+
+// Writes a new file and waits until its data and its name are on disk.
+void writeFileSynced(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+    bool ok = true;
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) throw Rt11Error(rt11::Error::Io, "Cannot create journal: " + path);
+    for (size_t done = 0; ok && done < bytes.size(); ) {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = false;
+        else        done += static_cast<size_t>(n);
+    }
+    if (ok && ::fsync(fd) != 0) ok = false;
+    if (::close(fd) != 0) ok = false;
+
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int dfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        if (::fsync(dfd) != 0) ok = false;
+        ::close(dfd);
+    }
+#else
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) throw Rt11Error(rt11::Error::Io, "Cannot create journal: " + path);
+    ok = std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size() &&
+         std::fflush(f) == 0 && _commit(_fileno(f)) == 0;
+    if (std::fclose(f) != 0) ok = false;
+#endif
+    if (!ok) throw Rt11Error(rt11::Error::Io, "Failed writing journal: " + path);
+}
+
+void writeJournal(const std::string& path,
+                  uint32_t totalBlocks,
+                  const std::vector<uint32_t>& blocks,
+                  const std::vector<const uint8_t*>& data)
+{
+    size_t n = blocks.size();
+    std::vector<uint8_t> out(JOURNAL_HEADER + n * (4 + BLOCK_SIZE) + 8);
+    std::memcpy(out.data(), JOURNAL_MAGIC, 8);
+    putLE(out.data() + 8, static_cast<uint64_t>(totalBlocks) * BLOCK_SIZE, 8);
+    putLE(out.data() + 16, n, 4);
+
+    uint8_t* p = out.data() + JOURNAL_HEADER;
+    for (uint32_t b : blocks) {
+        putLE(p, b, 4);
+        p += 4;
+    }
+    for (const uint8_t* d : data) {
+        std::memcpy(p, d, BLOCK_SIZE);
+        p += BLOCK_SIZE;
+    }
+    putLE(p, fnv1a(out.data(), out.size() - 8), 8);
+
+    writeFileSynced(path, out);
+}
+
+bool readJournal(const std::string& path,
+                 uint32_t totalBlocks,
+                 std::vector<uint32_t>& blocks,
+                 std::vector<uint8_t>& data)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::vector<uint8_t> j((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (j.size() < JOURNAL_HEADER + 8 || std::memcmp(j.data(), JOURNAL_MAGIC, 8) != 0) return false;
+
+    if (getLE(j.data() + 8, 8) != static_cast<uint64_t>(totalBlocks) * BLOCK_SIZE) return false;
+    uint64_t n = getLE(j.data() + 16, 4);
+    if (n > totalBlocks || j.size() != JOURNAL_HEADER + n * (4 + BLOCK_SIZE) + 8) return false;
+    if (getLE(j.data() + j.size() - 8, 8) != fnv1a(j.data(), j.size() - 8)) return false;
+
+    blocks.clear();
+    const uint8_t* p = j.data() + JOURNAL_HEADER;
+    for (uint64_t i = 0; i < n; ++i, p += 4) {
+        uint32_t b = static_cast<uint32_t>(getLE(p, 4));
+        if (b >= totalBlocks) return false;
+        blocks.push_back(b);
+    }
+    data.assign(p, p + n * BLOCK_SIZE);
+    return true;
+}
+
+// ------------------------------
+// Asynchronous copy queue (io_uring)
+// ------------------------------
+#ifdef RT11_HAVE_IO_URING
+// The submission and completion rings shared with the kernel.  Ring indexes
+// the kernel updates are read with acquire and ours published with release.
+struct IoQueue::Ring {
+    int fd = -1;
+    void* sqMap = MAP_FAILED;
+    size_t sqMapSize = 0;
+    void* cqMap = MAP_FAILED;
+    size_t cqMapSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0;
+    unsigned toSubmit = 0;
+
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    ~Ring();
+    bool setup(unsigned entries);
+    io_uring_sqe* nextSqe();
+    void submit(unsigned waitFor);
+
+    template <typename F>
+    void reap(F&& onCompletion) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) onCompletion(cqes[head & cqMask]);
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+IoQueue::Ring::~Ring() {
+    if (sqes) ::munmap(sqes, sqesSize);
+    if (cqMap != MAP_FAILED && cqMap != sqMap) ::munmap(cqMap, cqMapSize);
+    if (sqMap != MAP_FAILED) ::munmap(sqMap, sqMapSize);
+    if (fd >= 0) ::close(fd);
+}
+
+bool IoQueue::Ring::setup(unsigned entries) {
+    io_uring_params p{};
+    fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0) return false;
+
+    sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+
+    sqMap = ::mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) return false;
+    if (single) {
+        cqMap = sqMap;
+    } else {
+        cqMap = ::mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED) return false;
+    }
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* s = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(s);
+
+    uint8_t* sq = static_cast<uint8_t*>(sqMap);
+    sqHead    = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sqTail    = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sqArray   = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqMask    = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    sqLocalTail = *sqTail;
+
+    uint8_t* cq = static_cast<uint8_t*>(cqMap);
+    cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes   = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* IoQueue::Ring::nextSqe() {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head >= sqEntries) return nullptr;
+
+    unsigned idx = sqLocalTail & sqMask;
+    sqArray[idx] = idx;
+    ++sqLocalTail;
+    ++toSubmit;
+    std::memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+    return &sqes[idx];
+}
+
+// Hands new entries to the kernel and waits for at least `waitFor`
+// completions.
+void IoQueue::Ring::submit(unsigned waitFor) {
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    for (;;) {
+        long r = ::syscall(__NR_io_uring_enter, fd, toSubmit, waitFor,
+                           waitFor ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            throw Rt11Error(rt11::Error::Io, std::string("io_uring_enter failed: ") + std::strerror(errno));
+        }
+        toSubmit -= std::min<unsigned>(toSubmit, static_cast<unsigned>(r));
+        return;
+    }
+}
+#else
+struct IoQueue::Ring {};
+#endif
+
+IoQueue::IoQueue(unsigned depth)
+    : depth_(std::max(depth, 1u))
+{
+#ifdef RT11_HAVE_IO_URING
+    // Two entries per chunk: the read and the write linked to it
+    auto ring = std::make_unique<Ring>();
+    if (ring->setup(depth_ * 2)) {
+        ring_ = std::move(ring);
+        buffers_.resize(static_cast<size_t>(depth_) * COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+    }
+#endif
+}
+
+IoQueue::~IoQueue() {
+    ring_.reset();
+    try {
+        closeAdopted();
+    } catch (...) {
+    }
+}
+
+void IoQueue::copy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes) {
+    const uint64_t chunk = static_cast<uint64_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE;
+    for (uint64_t done = 0; done < bytes; done += chunk) {
+        pending_.push_back({inFd, inOffset + done, outFd, outOffset + done,
+                            static_cast<uint32_t>(std::min(chunk, bytes - done))});
+    }
+}
+
+void IoQueue::adopt(int fd, const std::string& name) {
+    adopted_.emplace_back(fd, name);
+}
+
+void IoQueue::drain() {
+    std::exception_ptr failure;
+    try {
+        runChunks();
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    pending_.clear();
+    try {
+        closeAdopted();
+    } catch (...) {
+        if (!failure) failure = std::current_exception();
+    }
+    if (failure) std::rethrow_exception(failure);
+}
+
+#ifndef _WIN32
+void IoQueue::runChunks() {
+    if (!ring_) {
+        std::vector<uint8_t> buf(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+        for (const auto& c : pending_) copyNow(c, buf.data());
+        return;
+    }
+
+#ifdef RT11_HAVE_IO_URING
+    struct Slot {
+        size_t chunk = 0;
+        int readRes = 0;
+        int writeRes = 0;
+        int outstanding = 0;
+    };
+    std::vector<Slot> slots(depth_);
+    std::vector<unsigned> freeSlots;
+    for (unsigned s = depth_; s-- > 0; ) freeSlots.push_back(s);
+
+    auto bufferOf = [&](unsigned s) {
+        return buffers_.data() + static_cast<size_t>(s) * COPY_CHUNK_BLOCKS * BLOCK_SIZE;
+    };
+
+    size_t next = 0;
+    unsigned inFlight = 0;
+    std::exception_ptr failure;
+
+    // A chunk is done once both of its completions are in.  Anything short
+    // of the full length (a short read, a cancelled write, an opcode the
+    // kernel lacks) is copied again synchronously.
+    auto complete = [&](unsigned s) {
+        const Slot& slot = slots[s];
+        const Chunk& c = pending_[slot.chunk];
+        bool full = slot.readRes == static_cast<int>(c.len) && slot.writeRes == static_cast<int>(c.len);
+        if (!full && !failure) {
+            try {
+                copyNow(c, bufferOf(s));
+            } catch (...) {
+                failure = std::current_exception();
+            }
+        }
+        freeSlots.push_back(s);
+        --inFlight;
+    };
+
+    for (;;) {
+        while (!failure && next < pending_.size() && !freeSlots.empty()) {
+            unsigned s = freeSlots.back();
+            freeSlots.pop_back();
+            const Chunk& c = pending_[next];
+            slots[s] = Slot{next, 0, 0, 2};
+
+            io_uring_sqe* rd = ring_->nextSqe();
+            io_uring_sqe* wr = ring_->nextSqe();
+            rd->opcode    = IORING_OP_READ;
+            rd->flags     = IOSQE_IO_LINK;
+            rd->fd        = c.inFd;
+            rd->addr      = reinterpret_cast<uintptr_t>(bufferOf(s));
+            rd->len       = c.len;
+            rd->off       = c.inOffset;
+            rd->user_data = s * 2u;
+            wr->opcode    = IORING_OP_WRITE;
+            wr->fd        = c.outFd;
+            wr->addr      = reinterpret_cast<uintptr_t>(bufferOf(s));
+            wr->len       = c.len;
+            wr->off       = c.outOffset;
+            wr->user_data = s * 2u + 1;
+            ++next;
+            ++inFlight;
+        }
+        if (inFlight == 0) break;
+
+        ring_->submit(1);
+        ring_->reap([&](const io_uring_cqe& cqe) {
+            unsigned s = static_cast<unsigned>(cqe.user_data / 2);
+            if (cqe.user_data & 1) slots[s].writeRes = cqe.res;
+            else                   slots[s].readRes  = cqe.res;
+            if (--slots[s].outstanding == 0) complete(s);
+        });
+    }
+    if (failure) std::rethrow_exception(failure);
+#endif
+}
+
+void IoQueue::copyNow(const Chunk& c, uint8_t* buf) {
+    auto nameOf = [this](int fd) -> std::string {
+        for (const auto& a : adopted_) {
+            if (a.first == fd) return a.second;
+        }
+        return "image";
+    };
+
+    for (size_t done = 0; done < c.len; ) {
+        ssize_t n = ::pread(c.inFd, buf + done, c.len - done, static_cast<off_t>(c.inOffset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) throw std::runtime_error("Input file changed size while copying: " + nameOf(c.inFd));
+        if (n < 0) {
+            throw Rt11Error(rt11::Error::Io, "Failed to read " + nameOf(c.inFd) + ": " + std::strerror(errno));
+        }
+        done += static_cast<size_t>(n);
+    }
+    for (size_t done = 0; done < c.len; ) {
+        ssize_t n = ::pwrite(c.outFd, buf + done, c.len - done, static_cast<off_t>(c.outOffset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw Rt11Error(rt11::Error::Io, "Failed writing to " + nameOf(c.outFd) + ": " +
+                                             std::strerror(n < 0 ? errno : EIO));
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+void IoQueue::closeAdopted() {
+    std::string failed;
+    for (const auto& a : adopted_) {
+        if (::close(a.first) != 0 && failed.empty()) failed = a.second;
+    }
+    adopted_.clear();
+    if (!failed.empty()) throw Rt11Error(rt11::Error::Io, "Failed writing to " + failed);
+}
+#else
+void IoQueue::runChunks() {
+    if (!pending_.empty()) throw std::runtime_error("Asynchronous copies are not supported on this platform");
+}
+
+void IoQueue::copyNow(const Chunk&, uint8_t*) {
+}
+
+void IoQueue::closeAdopted() {
+    adopted_.clear();
+}
+#endif
+
+// ------------------------------
+// RAD50 helpers
+// ------------------------------
+int rad50Index(char c) {
+    return RAD50_INDEX[static_cast<unsigned char>(c)];
+}
+
+const Rad50Text* rad50DecodeTable() {
+    static const std::vector<Rad50Text> table = [] {
+        std::vector<Rad50Text> t(65536);
+        for (uint32_t w = 0; w < 65536; ++w) {
+            char c[3];
+            if (w < 40 * 40 * 40) {
+                c[0] = RAD50_TABLE[w / 1600];
+                c[1] = RAD50_TABLE[(w / 40) % 40];
+                c[2] = RAD50_TABLE[w % 40];
+            } else {
+                c[0] = c[1] = c[2] = '?';
+            }
+            Rad50Text& r = t[w];
+            r = Rad50Text{{' ', ' ', ' '}, 0};
+            for (char ch : c) {
+                if (ch != ' ') r.chars[r.len++] = ch;
+            }
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+uint16_t encodeRad50(const std::string& s3) {
+    char c1 = (s3.size() > 0) ? s3[0] : ' ';
+    char c2 = (s3.size() > 1) ? s3[1] : ' ';
+    char c3 = (s3.size() > 2) ? s3[2] : ' ';
+    int i1 = rad50Index(c1);
+    int i2 = rad50Index(c2);
+    int i3 = rad50Index(c3);
+    return static_cast<uint16_t>(i1 * 1600 + i2 * 40 + i3);
+}
+
+std::string decodeRad50(uint16_t w) {
+    const Rad50Text& t = rad50DecodeTable()[w];
+    return std::string(t.chars, t.len);
+}
+
+// Writes NAME.EXT for one name (at most 10 chars) to `out`, returning the
+// length.
+size_t decodeFileNameTo(const Rad50Text* table, uint16_t name1, uint16_t name2, uint16_t ext,
+                        char* out)
+{
+    const Rad50Text& a = table[name1];
+    const Rad50Text& b = table[name2];
+    const Rad50Text& e = table[ext];
+
+    size_t n = 0;
+    std::memcpy(out + n, a.chars, 3); n += a.len;
+    std::memcpy(out + n, b.chars, 3); n += b.len;
+    if (e.len != 0) {
+        out[n++] = '.';
+        std::memcpy(out + n, e.chars, 3); n += e.len;
+    }
+    return n;
+}
+
+std::string decodeFileName(uint16_t name1, uint16_t name2, uint16_t ext) {
+    char buf[12];
+    size_t n = decodeFileNameTo(rad50DecodeTable(), name1, name2, ext, buf);
+    return std::string(buf, n);
+}
+
+std::string Rt11Entry::name() const {
+    return decodeFileName(rad50[0], rad50[1], rad50[2]);
+}
+
+// Decodes the names of a whole directory in one pass.  names[i] is the name
+// of entries[i] (empty entries decode to whatever their name words hold).
+void decodeFileNames(const std::vector<Rt11Entry>& entries, std::vector<std::string>& names)
+{
+    const Rad50Text* table = rad50DecodeTable();
+    names.resize(entries.size());
+    char buf[12];
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Rt11Entry& e = entries[i];
+        size_t n = decodeFileNameTo(table, e.rad50[0], e.rad50[1], e.rad50[2], buf);
+        names[i].assign(buf, n);
+    }
+}
+
+void encodeFileName(const std::string& rtname,
+                    uint16_t& name1,
+                    uint16_t& name2,
+                    uint16_t& ext)
+{
+    // NAME and EXT laid out as 9 RAD50 characters, space padded
+    char padded[9];
+    std::memset(padded, ' ', sizeof padded);
+
+    auto pos = rtname.find('.');
+    size_t baseLen = std::min<size_t>(pos == std::string::npos ? rtname.size() : pos, 6);
+    std::memcpy(padded, rtname.data(), baseLen);
+    if (pos != std::string::npos) {
+        size_t extLen = std::min<size_t>(rtname.size() - pos - 1, 3);
+        std::memcpy(padded + 6, rtname.data() + pos + 1, extLen);
+    }
+
+    uint16_t w[3];
+    for (int k = 0; k < 3; ++k) {
+        w[k] = static_cast<uint16_t>(RAD50_INDEX[static_cast<unsigned char>(padded[3*k])] * 1600 +
+                                     RAD50_INDEX[static_cast<unsigned char>(padded[3*k + 1])] * 40 +
+                                     RAD50_INDEX[static_cast<unsigned char>(padded[3*k + 2])]);
+    }
+    name1 = w[0];
+    name2 = w[1];
+    ext   = w[2];
+}
+
+// Encodes many NAME.EXT strings; rad50[i] holds name1, name2, ext of names[i].
+void encodeFileNames(const std::vector<std::string>& names,
+                     std::vector<std::array<uint16_t, 3>>& rad50)
+{
+    rad50.resize(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        encodeFileName(names[i], rad50[i][0], rad50[i][1], rad50[i][2]);
+    }
+}
+
+// ------------------------------
+// RT-11 filename normalization (for /copyto)
+// ------------------------------
+std::string normalizeRt11Name(const std::string& name) {
+    auto pos = name.find('.');
+    std::string base = (pos == std::string::npos) ? name : name.substr(0, pos);
+    std::string ext  = (pos == std::string::npos) ? ""   : name.substr(pos + 1);
+
+    if (base.empty()) throw Rt11Error(rt11::Error::InvalidName, "RT-11 filename must have a name");
+
+    std::string b = base;
+    std::string e = ext;
+    std::transform(b.begin(), b.end(), b.begin(),
+                   [](unsigned char c){ return static_cast<char>(std::toupper(c)); });
+    std::transform(e.begin(), e.end(), e.begin(),
+                   [](unsigned char c){ return static_cast<char>(std::toupper(c)); });
+
+    if (b.size() > 6) b = b.substr(0, 6);
+    if (e.size() > 3) e = e.substr(0, 3);
+
+    if (e.empty()) return b;
+    return b + "." + e;
+}
+
+// ------------------------------
+// RT-11 pattern matching (for /copyfrom)
+// ------------------------------
+std::string normalizePattern(const std::string& pattern) {
+    std::string p = pattern;
+    std::transform(p.begin(), p.end(), p.begin(),
+                   [](unsigned char c){ return static_cast<char>(std::toupper(c)); });
+    return p;
+}
+
+bool hasWildcard(const std::string& s) {
+    return s.find('*') != std::string::npos || s.find('?') != std::string::npos;
+}
+
+// Wildcard match of one name or extension: '*' matches any run of
+// characters (several stars allowed), '?' any single character.
+bool matchComponent(const std::string& value, const std::string& pattern) {
+    if (pattern.empty()) return true;
+
+    size_t n = 0, p = 0, star = std::string::npos, mark = 0;
+
+    while (n < value.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == value[n])) {
+            ++p;
+            ++n;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
+
+bool matchRt11Pattern(const std::string& rtName, const std::string& pattern) {
+    std::string valueName, valueExt;
+    auto vpos = rtName.find('.');
+    if (vpos == std::string::npos) {
+        valueName = rtName;
+        valueExt.clear();
+    } else {
+        valueName = rtName.substr(0, vpos);
+        valueExt  = rtName.substr(vpos + 1);
+    }
+
+    std::string patName, patExt;
+    auto ppos = pattern.find('.');
+    if (ppos == std::string::npos) {
+        patName = pattern;
+        patExt.clear();
+    } else {
+        patName = pattern.substr(0, ppos);
+        patExt  = pattern.substr(ppos + 1);
+    }
+
+    return matchComponent(valueName, patName) &&
+           matchComponent(valueExt,  patExt);
+}
+
+// Splits a comma-separated /copyfrom: or /exclude: list
+std::vector<std::string> splitPatternList(const std::string& list) {
+    std::vector<std::string> out;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(item);
+    }
+    return out;
+}
+
+// ------------------------------
+// RT-11 date encode/decode
+// ------------------------------
+std::string formatRt11Date(uint16_t dateWord) {
+    if (dateWord == 0) return "        ";
+
+    uint16_t age   = (dateWord >> 14) & 0x3;
+    uint16_t month = (dateWord >> 10) & 0xF;
+    uint16_t day   = (dateWord >> 5)  & 0x1F;
+    uint16_t yl    = dateWord & 0x1F;
+
+    int year = 1972 + yl + 32 * age;
+
+    static const char* monthNames[13] = {
+        "", "Jan","Feb","Mar","Apr","May","Jun",
+        "Jul","Aug","Sep","Oct","Nov","Dec"
+    };
+
+    if (month < 1 || month > 12 || day < 1 || day > 31) return "        ";
+
+    std::ostringstream oss;
+    int year2 = year % 100;
+    oss << std::setw(2) << std::setfill('0') << day << "-"
+        << monthNames[month] << "-"
+        << std::setw(2) << std::setfill('0') << year2;
+    return oss.str();
+}
+
+uint16_t encodeRt11DateFromSystem() {
+    std::time_t t = std::time(nullptr);
+    std::tm tmLocal{};
+#ifdef _WIN32
+    localtime_s(&tmLocal, &t);
+#else
+    tmLocal = *std::localtime(&t);
+#endif
+
+    int year  = tmLocal.tm_year + 1900;
+    int month = tmLocal.tm_mon + 1;
+    int day   = tmLocal.tm_mday;
+
+    if (year < 1972) return 0;
+
+    int yearOffset = year - 1972;
+    int age = yearOffset / 32;
+    if (age > 3) age = 3;
+    int base = 1972 + age * 32;
+    int yearLow = year - base;
+    if (yearLow < 0) yearLow = 0;
+    if (month < 1 || month > 12 || day < 1 || day > 31) return 0;
+
+    uint16_t dw = 0;
+    dw |= static_cast<uint16_t>((age & 0x3)   << 14);
+    dw |= static_cast<uint16_t>((month & 0xF) << 10);
+    dw |= static_cast<uint16_t>((day & 0x1F)  << 5);
+    dw |= static_cast<uint16_t>(yearLow & 0x1F);
+    return dw;
+}
+
+// Parse date string in format dd-MMM-yy (e.g., "15-JAN-97")
+// Returns true if successful, false otherwise
+bool parseDateString(const std::string& dateStr, int& day, int& month, int& year) {
+    static const char* monthNames[12] = {
+        "JAN", "FEB", "MAR", "APR", "MAY", "JUN",
+        "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"
+    };
+    
+    // Expected format: dd-MMM-yy (e.g., "15-JAN-97" or "01-FEB-99")
+    if (dateStr.size() != 9) return false;
+    if (dateStr[2] != '-' || dateStr[6] != '-') return false;
+    
+    // Parse day
+    try {
+        day = std::stoi(dateStr.substr(0, 2));
+        if (day < 1 || day > 31) return false;
+    } catch (...) {
+        return false;
+    }
+    
+    // Parse month
+    std::string monthStr = dateStr.substr(3, 3);
+    std::transform(monthStr.begin(), monthStr.end(), monthStr.begin(),
+                   [](unsigned char c){ return static_cast<char>(std::toupper(c)); });
+    
+    month = 0;
+    for (int i = 0; i < 12; ++i) {
+        if (monthStr == monthNames[i]) {
+            month = i + 1;  // 1-based month
+            break;
+        }
+    }
+    if (month == 0) return false;
+    
+    // Parse year (2-digit)
+    try {
+        int year2 = std::stoi(dateStr.substr(7, 2));
+        
+        // Interpret 2-digit year: 72-99 -> 1972-1999, 00-71 -> 2000-2071
+        if (year2 >= 72) {
+            year = 1900 + year2;
+        } else {
+            year = 2000 + year2;
+        }
+        
+        // RT-11 date format supports 1972-2099
+        if (year < 1972 || year > 2099) return false;
+    } catch (...) {
+        return false;
+    }
+    
+    return true;
+}
+
+// Encode specific date to RT-11 format
+uint16_t encodeRt11Date(int year, int month, int day) {
+    if (year < 1972 || year > 2099) return 0;
+    if (month < 1 || month > 12 || day < 1 || day > 31) return 0;
+
+    int yearOffset = year - 1972;
+    int age = yearOffset / 32;
+    if (age > 3) age = 3;
+    int base = 1972 + age * 32;
+    int yearLow = year - base;
+    if (yearLow < 0) yearLow = 0;
+
+    uint16_t dw = 0;
+    dw |= static_cast<uint16_t>((age & 0x3)   << 14);
+    dw |= static_cast<uint16_t>((month & 0xF) << 10);
+    dw |= static_cast<uint16_t>((day && 0x1F)  << 5);
+    dw |= static_cast<uint16_t>(yearLow & 0x1F);
+    return dw;
+}
+
+// ------------------------------
+// Home block / first dir block
+// ------------------------------
+uint16_t homeBlockChecksum(const uint16_t* words) {
+    uint16_t sum = 0;
+    for (int i = 0; i < HOME_CHECKSUM_WORD; ++i) sum = static_cast<uint16_t>(sum + words[i]);
+    return sum;
+}
+
+std::string octalWord(uint16_t w) {
+    char buf[8];
+    std::snprintf(buf, sizeof(buf), "%06o", static_cast<unsigned>(w));
+    return buf;
+}
+
+bool readHomeBlock(BlockCache& cache, uint16_t* words) {
+    unpackWords(cache.read(1), words, 256);
+    return words[HOME_CHECKSUM_WORD] == homeBlockChecksum(words);
+}
+
+uint32_t getFirstDirectoryBlock(const uint16_t* homeWords) {
+    // Octal 724 = decimal 468 bytes = word 234
+    const int wordIndex = 234;
+    uint16_t firstDirBlock = homeWords[wordIndex];
+    if (firstDirBlock == 0) return 6;
+    return firstDirBlock;
+}
+
+uint32_t getFirstDirectoryBlock(BlockCache& cache) {
+    uint16_t words[256];
+    readHomeBlock(cache, words);
+    return getFirstDirectoryBlock(words);
+}
+
+void checkBadBlockTable(BlockCache& cache) {
+    uint16_t words[256];
+    bool checksumOk = readHomeBlock(cache, words);
+    
+    std::cout << "\n=== BAD BLOCK TABLE ===\n";
+    std::cout << "Home block bad block table (starts at word 16 / octal byte 040):\n";
+    
+    // Bad block table starts at octal 040 (decimal 32 bytes = word 16)
+    // Each entry is 2 words: block number, count
+    bool foundBad = false;
+    for (int i = 16; i < 16 + 65; i += 2) {
+        uint16_t blockNum = words[i];
+        uint16_t count = words[i + 1];
+        
+        if (blockNum == 0 && count == 0) {
+            // End of bad block table
+            break;
+        }
+        
+        if (blockNum != 0 || count != 0) {
+            std::cout << "  Entry " << ((i - 16) / 2) << ": Block " << blockNum 
+                      << ", Count " << count << "\n";
+            foundBad = true;
+        }
+    }
+    
+    if (!foundBad) {
+        std::cout << "  (No bad blocks registered)\n";
+    }
+    
+    std::cout << "\nOther home block info:\n";
+    // Octal 724 = decimal 468 bytes = word 234
+    std::cout << "  First directory block (word 234 / octal byte 724): " << words[234] << "\n";
+    // Octal 722 = decimal 466 bytes = word 233
+    std::cout << "  Pack cluster size (word 233 / octal byte 722): " << words[233] << "\n";
+    // Octal 726 = decimal 470 bytes = word 235
+    std::cout << "  System version (word 235 / octal byte 726): " << std::hex << words[235] << std::dec << "\n";
+    // Octal 776 = decimal 510 bytes = word 255
+    std::cout << "  Checksum (word 255 / octal byte 776): " << octalWord(words[HOME_CHECKSUM_WORD]);
+    if (checksumOk) std::cout << " (valid)\n";
+    else            std::cout << " (should be " << octalWord(homeBlockChecksum(words)) << "; /fixhome rewrites it)\n";
+}
+
+// Recomputes the checksum and writes it back through the cache, so on a
+// journaled device it is committed like a directory change.  Returns
+// whether the home block was rewritten.
+bool fixHomeBlock(BlockCache& cache, std::ostream& log)
+{
+    uint16_t words[256];
+    if (readHomeBlock(cache, words)) {
+        log << "Home block checksum is already correct (" << octalWord(words[HOME_CHECKSUM_WORD]) << ")\n";
+        return false;
+    }
+
+    uint16_t old = words[HOME_CHECKSUM_WORD];
+    words[HOME_CHECKSUM_WORD] = homeBlockChecksum(words);
+    uint8_t buf[BLOCK_SIZE];
+    packWords(words, buf, 256);
+    cache.write(1, buf);
+    cache.flush();
+
+    log << "Home block checksum " << octalWord(old) << " -> " << octalWord(words[HOME_CHECKSUM_WORD]) << "\n";
+    return true;
+}
+
+// ------------------------------
+// Directory parsing
+// ------------------------------
+DirSegmentHeader parseSegmentHeader(const uint16_t* words) {
+    DirSegmentHeader h{};
+    h.totalSegments   = words[0];
+    h.nextSegment     = words[1];
+    h.highestInUse    = words[2];
+    h.extraBytes      = words[3];
+    h.dataStartBlock  = words[4];
+    return h;
+}
+
+// Appends the entries of one directory segment and returns its link to the
+// next logical segment. `offset` is the running block offset from the data
+// start block, carried from one segment to the next.
+uint16_t parseSegmentEntries(const uint16_t* words,
+                             uint16_t segNum,
+                             uint32_t dataStartBlock,
+                             uint32_t& offset,
+                             std::vector<Rt11Entry>& entries)
+{
+    DirSegmentHeader hdr = parseSegmentHeader(words);
+    uint16_t extraWordsSeg = hdr.extraBytes / 2;
+    uint16_t entryWordsSeg = 7 + extraWordsSeg;
+
+    uint16_t idx = 5;
+
+    // Parse entries until we hit EOS
+    while (idx + entryWordsSeg <= 512) {
+        uint16_t status = words[idx + 0];
+        
+        // Check for end-of-segment marker (E_EOS bit set)
+        if (status & E_EOS) {
+            break;  // End of this segment
+        }
+        
+        // Skip if status is 0 (shouldn't happen but be safe)
+        if (status == 0) {
+            break;
+        }
+
+        uint16_t name1 = words[idx + 1];
+        uint16_t name2 = words[idx + 2];
+        uint16_t ext   = words[idx + 3];
+        uint16_t len   = words[idx + 4];
+        uint16_t dateW = words[idx + 6];
+
+        Rt11Entry e;
+        e.segNumber    = segNum;
+        e.wordIndex    = idx;
+        e.status       = status;
+        e.lengthBlocks = len;
+        e.dateWord     = dateW;
+        e.rad50[0]     = name1;
+        e.rad50[1]     = name2;
+        e.rad50[2]     = ext;
+
+        // Calculate start block using GLOBAL cumulative offset and dataStartBlock from first segment
+        uint32_t start = dataStartBlock + offset;
+        e.startBlock = static_cast<uint16_t>(start);
+
+        entries.push_back(e);
+
+        // Increment GLOBAL cumulative offset for next entry
+        offset += len;
+        idx = static_cast<uint16_t>(idx + entryWordsSeg);
+    }
+
+    return hdr.nextSegment;
+}
+
+void readDirectory(BlockCache& cache, std::vector<Rt11Entry>& entries)
+{
+    entries.clear();
+
+    uint32_t totalBlocks = cache.totalBlocks();
+    uint32_t firstDirBlock = getFirstDirectoryBlock(cache);
+    if (firstDirBlock >= totalBlocks) {
+        throw Rt11Error(rt11::Error::BadDirectory, "First directory block out of range");
+    }
+
+    // Read the first segment to get total segments count
+    const uint8_t* segBuf0 = cache.read(firstDirBlock);
+    const uint8_t* segBuf1 = cache.read(firstDirBlock + 1);
+
+    uint16_t segWords[512];
+    unpackWords(segBuf0, segWords, 256);
+    unpackWords(segBuf1, segWords + 256, 256);
+
+    DirSegmentHeader firstHeader = parseSegmentHeader(segWords);
+    uint16_t totalSegments = firstHeader.totalSegments;
+    if (totalSegments == 0 || totalSegments > 31) totalSegments = 1;
+    cache.prefetch(firstDirBlock, std::min<uint32_t>(totalSegments * DIR_SEGMENT_BLOCKS,
+                                                     totalBlocks - firstDirBlock));
+
+    // Get the data start block from the first segment - this applies to ALL segments
+    uint32_t dataStartBlock = firstHeader.dataStartBlock;
+
+    // Follow the linked list of segments starting from segment 1
+    uint16_t currentSegNum = 1;  // Start with logical segment 1
+    std::vector<bool> visitedSegments(totalSegments + 1, false);
+    
+    // Track cumulative offset ACROSS ALL SEGMENTS
+    uint32_t globalCumulativeOffset = 0;
+
+    while (currentSegNum != 0) {
+        // Prevent infinite loops
+        if (currentSegNum < 1 || currentSegNum > totalSegments) {
+            std::cerr << "Warning: Invalid segment number " << currentSegNum 
+                      << " in directory chain\n";
+            break;
+        }
+        
+        if (visitedSegments[currentSegNum]) {
+            std::cerr << "Warning: Directory loop detected at segment " 
+                      << currentSegNum << "\n";
+            break;
+        }
+        visitedSegments[currentSegNum] = true;
+
+        // Calculate physical block location for this segment
+        uint32_t segBlock = firstDirBlock + (currentSegNum - 1) * DIR_SEGMENT_BLOCKS;
+        if (segBlock + 1 >= totalBlocks) {
+            std::cerr << "Warning: Segment " << currentSegNum 
+                      << " is beyond volume bounds\n";
+            break;
+        }
+
+        const uint8_t* buf0 = cache.read(segBlock);
+        const uint8_t* buf1 = cache.read(segBlock + 1);
+
+        uint16_t words[512];
+        unpackWords(buf0, words, 256);
+        unpackWords(buf1, words + 256, 256);
+
+        // Follow the link to the next logical segment
+        currentSegNum = parseSegmentEntries(words, currentSegNum, dataStartBlock,
+                                            globalCumulativeOffset, entries);
+    }
+}
+
+// ------------------------------
+// Sidecar directory index (<image>.r11idx)
+// ------------------------------
+// The parsed directory of an image, kept next to it so large libraries can
+// be listed without parsing every directory again.  The index records the
+// image's size and modification time and a hash of the home block and
+// directory segments.  If size and time match, the index is used as is;
+// otherwise the directory blocks are hashed, and the index is rebuilt
+// only if they changed.
+//
+// Layout (little-endian): 8-byte magic, u32 entry count, u64 image size,
+// i64 modification time, u64 directory hash, then per entry nine u16
+// words: status, name1, name2, ext, start, length, date, segment, word.
+static const char DIR_INDEX_MAGIC[8] = {'R', '1', '1', 'I', 'D', 'X', '0', '1'};
+static constexpr size_t DIR_INDEX_HEADER = 8 + 4 + 8 + 8 + 8;
+static constexpr size_t DIR_INDEX_ENTRY  = 9 * 2;
+
+std::string directoryIndexPath(const std::string& imagePath) {
+    return imagePath + ".r11idx";
+}
+
+// False for anything that is not a regular file (pipes, devices)
+bool imageStamp(const std::string& imagePath, ImageStamp& stamp) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(imagePath, ec)) return false;
+    stamp.size = std::filesystem::file_size(imagePath, ec);
+    if (ec) return false;
+    auto t = std::filesystem::last_write_time(imagePath, ec);
+    if (ec) return false;
+    stamp.mtime = static_cast<int64_t>(t.time_since_epoch().count());
+    return true;
+}
+
+// FNV-1a over the home block and every directory segment on the volume
+uint64_t hashDirectoryBlocks(BlockCache& cache) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = fnv1a(cache.read(1), BLOCK_SIZE, h);
+
+    uint32_t firstDirBlock = getFirstDirectoryBlock(cache);
+    if (firstDirBlock + 1 >= cache.totalBlocks()) return h;
+    const uint8_t* seg1 = cache.read(firstDirBlock);
+    uint16_t totalSegments;
+    unpackWords(seg1, &totalSegments, 1);
+    if (totalSegments == 0 || totalSegments > 31) totalSegments = 1;
+
+    uint32_t end = std::min<uint32_t>(firstDirBlock + totalSegments * DIR_SEGMENT_BLOCKS,
+                                      cache.totalBlocks());
+    cache.prefetch(firstDirBlock, end - firstDirBlock);
+    for (uint32_t b = firstDirBlock; b < end; ++b) h = fnv1a(cache.read(b), BLOCK_SIZE, h);
+    return h;
+}
+
+bool loadDirectoryIndex(const std::string& indexPath,
+                        ImageStamp& stamp,
+                        uint64_t& dirHash,
+                        std::vector<Rt11Entry>& entries)
+{
+    std::ifstream in(indexPath, std::ios::binary);
+    if (!in) return false;
+
+    uint8_t hdr[DIR_INDEX_HEADER];
+    if (!in.read(reinterpret_cast<char*>(hdr), sizeof hdr)) return false;
+    if (std::memcmp(hdr, DIR_INDEX_MAGIC, 8) != 0) return false;
+
+    uint32_t count = static_cast<uint32_t>(getLE(hdr + 8, 4));
+    stamp.size  = getLE(hdr + 12, 8);
+    stamp.mtime = static_cast<int64_t>(getLE(hdr + 20, 8));
+    dirHash     = getLE(hdr + 28, 8);
+
+    // 31 segments of at most 72 entries each
+    if (count > 31 * 72) return false;
+
+    std::vector<uint8_t> body(static_cast<size_t>(count) * DIR_INDEX_ENTRY);
+    if (!in.read(reinterpret_cast<char*>(body.data()), static_cast<std::streamsize>(body.size()))) {
+        return false;
+    }
+
+    entries.clear();
+    entries.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t* p = body.data() + static_cast<size_t>(i) * DIR_INDEX_ENTRY;
+        uint16_t w[9];
+        unpackWords(p, w, 9);
+
+        Rt11Entry e;
+        e.status       = w[0];
+        e.rad50[0]     = w[1];
+        e.rad50[1]     = w[2];
+        e.rad50[2]     = w[3];
+        e.startBlock   = w[4];
+        e.lengthBlocks = w[5];
+        e.dateWord     = w[6];
+        e.segNumber    = w[7];
+        e.wordIndex    = w[8];
+        entries.push_back(e);
+    }
+    return true;
+}
+
+// Written to a temporary file and renamed into place, so readers never see
+// a partial index.  Failure to write is not an error: the index is only a
+// cache.
+void saveDirectoryIndex(const std::string& indexPath,
+                        const ImageStamp& stamp,
+                        uint64_t dirHash,
+                        const std::vector<Rt11Entry>& entries)
+{
+    std::vector<uint8_t> out(DIR_INDEX_HEADER + entries.size() * DIR_INDEX_ENTRY);
+    std::memcpy(out.data(), DIR_INDEX_MAGIC, 8);
+    putLE(out.data() + 8, entries.size(), 4);
+    putLE(out.data() + 12, stamp.size, 8);
+    putLE(out.data() + 20, static_cast<uint64_t>(stamp.mtime), 8);
+    putLE(out.data() + 28, dirHash, 8);
+
+    uint8_t* p = out.data() + DIR_INDEX_HEADER;
+    for (const auto& e : entries) {
+        const uint16_t w[9] = {e.status, e.rad50[0], e.rad50[1], e.rad50[2], e.startBlock,
+                               e.lengthBlocks, e.dateWord, e.segNumber, e.wordIndex};
+        for (int k = 0; k < 9; ++k) putLE(p + 2*k, w[k], 2);
+        p += DIR_INDEX_ENTRY;
+    }
+
+    std::string tmp = indexPath + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) return;
+        f.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+        if (!f) return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, indexPath, ec);
+    if (ec) std::filesystem::remove(tmp, ec);
+}
+
+// readDirectory() through the sidecar index of `imagePath`.  With `strict`
+// the directory is parsed by readDirectoryStrict() when the index cannot
+// be used.
+void readDirectoryIndexed(BlockCache& cache,
+                          const std::string& imagePath,
+                          std::vector<Rt11Entry>& entries,
+                          bool strict)
+{
+    auto parse = [&]() {
+        if (strict) readDirectoryStrict(cache, entries);
+        else        readDirectory(cache, entries);
+    };
+
+    ImageStamp now;
+    if (!imageStamp(imagePath, now)) {
+        parse();
+        return;
+    }
+
+    std::string indexPath = directoryIndexPath(imagePath);
+    ImageStamp saved;
+    uint64_t savedHash = 0;
+    bool haveIndex = loadDirectoryIndex(indexPath, saved, savedHash, entries);
+    if (haveIndex && saved.size == now.size && saved.mtime == now.mtime) return;
+
+    uint64_t hash = hashDirectoryBlocks(cache);
+    if (!haveIndex || hash != savedHash) parse();
+    saveDirectoryIndex(indexPath, now, hash, entries);
+}
+
+// Brings an existing (or, with `create`, a new) index up to date after the
+// directory has been rewritten.  Size and time alone cannot be trusted
+// here, since writes through a mapping may not have touched the time yet.
+void refreshDirectoryIndex(BlockCache& cache, const std::string& imagePath, bool create)
+{
+    std::string indexPath = directoryIndexPath(imagePath);
+    if (!create && !std::filesystem::exists(indexPath)) return;
+
+    ImageStamp now;
+    if (!imageStamp(imagePath, now)) return;
+
+    std::vector<Rt11Entry> entries;
+    readDirectory(cache, entries);
+    saveDirectoryIndex(indexPath, now, hashDirectoryBlocks(cache), entries);
+}
+
+// ------------------------------
+// Machine-readable listings (/format:jsonl, /format:csv)
+// ------------------------------
+bool parseListFormat(const std::string& s, ListFormat& format) {
+    std::string f = normalizePattern(s);
+    if      (f == "TEXT")  format = ListFormat::Text;
+    else if (f == "JSONL") format = ListFormat::Jsonl;
+    else if (f == "CSV")   format = ListFormat::Csv;
+    else return false;
+    return true;
+}
+
+static const char CSV_HEADER[] =
+    "image,name,type,status,start,length,date,date_word,segment,word\n";
+
+const char* entryType(const Rt11Entry& e) {
+    if (e.permanent()) return "file";
+    if (e.empty())     return "empty";
+    if (e.tentative()) return "tentative";
+    return "other";
+}
+
+void appendNumber(std::string& buf, uint64_t v) {
+    char tmp[24];
+    size_t n = 0;
+    do {
+        tmp[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) buf.push_back(tmp[--n]);
+}
+
+void appendJsonString(std::string& buf, const std::string& s) {
+    static const char hex[] = "0123456789abcdef";
+    buf.push_back('"');
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            buf.push_back('\\');
+            buf.push_back(static_cast<char>(c));
+        } else if (c < 0x20) {
+            buf += "\\u00";
+            buf.push_back(hex[c >> 4]);
+            buf.push_back(hex[c & 0xF]);
+        } else {
+            buf.push_back(static_cast<char>(c));
+        }
+    }
+    buf.push_back('"');
+}
+
+void appendCsvField(std::string& buf, const std::string& s) {
+    if (s.find_first_of(",\"\r\n") == std::string::npos) {
+        buf += s;
+        return;
+    }
+    buf.push_back('"');
+    for (char c : s) {
+        if (c == '"') buf.push_back('"');
+        buf.push_back(c);
+    }
+    buf.push_back('"');
+}
+
+// Appends one record for `e` (every kind of entry, not just files).  Empty
+// entries have an empty name and date.
+void appendEntryRecord(std::string& buf,
+                       ListFormat format,
+                       const std::string& image,
+                       const Rt11Entry& e,
+                       const std::string& name)
+{
+    bool named = !e.empty();
+    std::string date = (named && e.dateWord != 0) ? formatRt11Date(e.dateWord) : std::string();
+
+    if (format == ListFormat::Jsonl) {
+        buf += "{\"image\":";
+        appendJsonString(buf, image);
+        buf += ",\"name\":";
+        appendJsonString(buf, named ? name : std::string());
+        buf += ",\"type\":\"";
+        buf += entryType(e);
+        buf += "\",\"status\":";      appendNumber(buf, e.status);
+        buf += ",\"start\":";         appendNumber(buf, e.startBlock);
+        buf += ",\"length\":";        appendNumber(buf, e.lengthBlocks);
+        buf += ",\"date\":";
+        appendJsonString(buf, date);
+        buf += ",\"date_word\":";     appendNumber(buf, e.dateWord);
+        buf += ",\"segment\":";       appendNumber(buf, e.segNumber);
+        buf += ",\"word\":";          appendNumber(buf, e.wordIndex);
+        buf += "}\n";
+    } else {
+        appendCsvField(buf, image);
+        buf.push_back(',');
+        if (named) buf += name;
+        buf.push_back(',');
+        buf += entryType(e);
+        buf.push_back(','); appendNumber(buf, e.status);
+        buf.push_back(','); appendNumber(buf, e.startBlock);
+        buf.push_back(','); appendNumber(buf, e.lengthBlocks);
+        buf.push_back(','); buf += date;
+        buf.push_back(','); appendNumber(buf, e.dateWord);
+        buf.push_back(','); appendNumber(buf, e.segNumber);
+        buf.push_back(','); appendNumber(buf, e.wordIndex);
+        buf.push_back('\n');
+    }
+}
+
+// Records for a whole directory, handed to `out` in large writes.
+void writeEntryRecords(std::ostream& out,
+                       ListFormat format,
+                       const std::string& image,
+                       const std::vector<Rt11Entry>& entries)
+{
+    std::vector<std::string> names;
+    decodeFileNames(entries, names);
+
+    std::string buf;
+    buf.reserve(OUTPUT_BUFFER_BYTES + 512);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        appendEntryRecord(buf, format, image, entries[i], names[i]);
+        if (buf.size() >= OUTPUT_BUFFER_BYTES) {
+            out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+            buf.clear();
+        }
+    }
+    out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+}
+
+// ------------------------------
+// Directory listing
+// ------------------------------
+void printDirectory(std::ostream& out,
+                    const std::string& imagePath,
+                    const std::vector<Rt11Entry>& entries,
+                    bool brief,
+                    bool showEmpty,
+                    ListFormat format)
+{
+    if (format != ListFormat::Text) {
+        if (format == ListFormat::Csv) out << CSV_HEADER;
+        writeEntryRecords(out, format, imagePath, entries);
+        return;
+    }
+
+    out << "Directory of " << imagePath << "\n\n";
+
+    uint32_t totalUsed = 0;
+    uint32_t totalFree = 0;
+    uint32_t fileCount = 0;
+
+    DirectoryColumns cols(entries);
+    for (size_t i = 0; i < cols.size(); ++i) {
+        if (cols.status[i] & E_PERM) {
+            totalUsed += cols.lengthBlocks[i];
+            fileCount++;
+        }
+        if (cols.status[i] & E_MPTY) totalFree += cols.lengthBlocks[i];
+    }
+
+    std::vector<std::string> names;
+    decodeFileNames(entries, names);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Rt11Entry& e = entries[i];
+        if (e.empty() && !showEmpty) continue;
+        if (!e.permanent() && !e.empty()) continue;
+
+        if (brief) {
+            if (e.empty()) out << "<EMPTY>\n";
+            else           out << names[i] << "\n";
+            continue;
+        }
+
+        if (e.empty()) {
+            out << std::left << std::setw(12) << "<EMPTY>"
+                << " len="   << std::setw(6) << e.lengthBlocks
+                << " start=" << std::setw(6) << e.startBlock
+                << "\n";
+        } else {
+            std::string dateStr = formatRt11Date(e.dateWord);
+            out << std::left << std::setw(12) << names[i]
+                << " len="   << std::setw(6) << e.lengthBlocks
+                << " start=" << std::setw(6) << e.startBlock
+                << " "      << dateStr
+                << "\n";
+        }
+    }
+
+    out << "\n"
+        << "Files: " << fileCount << "\n"
+        << "Total used blocks: " << totalUsed << "\n"
+        << "Total free blocks: " << totalFree << "\n";
+}
+
+void showDirectory(BlockCache& cache,
+                   const std::string& imagePath,
+                   bool brief,
+                   bool showEmpty,
+                   bool useIndex,
+                   ListFormat format)
+{
+    std::vector<Rt11Entry> entries;
+    if (useIndex) readDirectoryIndexed(cache, imagePath, entries);
+    else          readDirectory(cache, entries);
+    printDirectory(std::cout, imagePath, entries, brief, showEmpty, format);
+}
+
+// ------------------------------
+// Catalog of an image tree (/catalog)
+// ------------------------------
+bool looksLikeImage(const std::filesystem::path& p) {
+    static const char* const exts[] = {
+        ".DSK", ".IMG", ".RK", ".RK05", ".RL", ".RL01", ".RL02",
+        ".RX", ".RX01", ".RX02", ".RX50", ".RD", ".RA"
+    };
+    std::string ext = normalizePattern(p.extension().string());
+    for (const char* e : exts) {
+        if (ext == e) return true;
+    }
+    return false;
+}
+
+// Recursively lists the image files under `root`, sorted by path.
+// Unreadable folders are skipped.
+std::vector<std::filesystem::path> findImages(const std::filesystem::path& root) {
+    std::vector<std::filesystem::path> images;
+    std::error_code ec;
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (std::filesystem::recursive_directory_iterator it(root, options, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec) && looksLikeImage(it->path())) {
+            images.push_back(it->path());
+        }
+    }
+    if (ec) throw std::runtime_error("Cannot scan " + root.string() + ": " + ec.message());
+    std::sort(images.begin(), images.end());
+    return images;
+}
+
+// One line per file: image, name, length, start block and date.
+void formatCatalogEntries(const std::string& image,
+                          const std::vector<Rt11Entry>& entries,
+                          bool showEmpty,
+                          std::ostream& out)
+{
+    std::vector<std::string> names;
+    decodeFileNames(entries, names);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Rt11Entry& e = entries[i];
+        if (e.empty() && !showEmpty) continue;
+        if (!e.permanent() && !e.empty()) continue;
+
+        out << image << "  "
+            << std::left << std::setw(12) << (e.empty() ? std::string("<EMPTY>") : names[i])
+            << " len="   << std::setw(6) << e.lengthBlocks
+            << " start=" << std::setw(6) << e.startBlock;
+        if (!e.empty()) out << " " << formatRt11Date(e.dateWord);
+        out << std::right << "\n";
+    }
+}
+
+// Reads the directories of every image under `root` on `jobs` threads and
+// prints one combined listing.  Each image's lines are printed together as
+// soon as it has been read, so images appear in completion order.  An
+// image that cannot be read, or whose segment chain is broken, is reported
+// with its path and counted as failed.
+void catalogImages(const std::string& root,
+                   bool showEmpty,
+                   unsigned jobs,
+                   bool useIndex,
+                   ListFormat format)
+{
+    std::vector<std::filesystem::path> images = findImages(root);
+    if (images.empty()) throw std::runtime_error("No disk images found under " + root);
+
+    std::mutex outMutex;
+    std::atomic<size_t> next{0};
+    std::atomic<uint64_t> fileCount{0};
+    std::atomic<size_t> failed{0};
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < images.size(); i = next++) {
+            std::string image = images[i].string();
+            std::ostringstream lines;
+            try {
+                BlockDevice dev(image, false);
+                BlockCache cache(dev);
+                std::vector<Rt11Entry> entries;
+                if (useIndex) readDirectoryIndexed(cache, image, entries, true);
+                else          readDirectoryStrict(cache, entries);
+
+                for (const auto& e : entries) {
+                    if (e.permanent()) ++fileCount;
+                }
+                if (format == ListFormat::Text) formatCatalogEntries(image, entries, showEmpty, lines);
+                else                            writeEntryRecords(lines, format, image, entries);
+            } catch (const std::exception& ex) {
+                ++failed;
+                std::lock_guard<std::mutex> lock(outMutex);
+                std::cerr << "Error: " << image << ": " << ex.what() << "\n";
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(outMutex);
+            std::cout << lines.str() << std::flush;
+        }
+    };
+
+    if (format == ListFormat::Csv) std::cout << CSV_HEADER;
+
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(std::max(1u, jobs), images.size()));
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+
+    // Records only on stdout for the machine-readable formats
+    std::ostream& summary = (format == ListFormat::Text) ? std::cout : std::cerr;
+    summary << (format == ListFormat::Text ? "\n" : "")
+            << "Images: " << images.size() - failed << " read, " << failed << " failed\n"
+            << "Files: " << fileCount << "\n";
+}
+
+// ------------------------------
+// Copy FROM RT-11 -> Windows
+// ------------------------------
+#ifdef __linux__
+// Moves up to `bytes` of the image at `offset` to the current position of
+// `outFd` inside the kernel, with copy_file_range or else sendfile. Returns
+// how much was moved; a short count means neither call works for this pair
+// of files and the caller writes the rest itself.
+size_t kernelCopy(int inFd, uint64_t offset, int outFd, size_t bytes)
+{
+    size_t done = 0;
+    bool tryCopyRange = true;
+    while (done < bytes) {
+        off_t inOff = static_cast<off_t>(offset + done);
+        ssize_t n;
+        if (tryCopyRange) {
+            n = ::copy_file_range(inFd, &inOff, outFd, nullptr, bytes - done, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                          errno == EINVAL || errno == EOPNOTSUPP)) {
+                tryCopyRange = false;
+                continue;
+            }
+        } else {
+            n = ::sendfile(outFd, inFd, &inOff, bytes - done);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("Kernel copy failed: ") + std::strerror(errno));
+        }
+        if (n == 0) break;
+        done += static_cast<size_t>(n);
+    }
+    return done;
+}
+
+void writeAll(int fd, const uint8_t* data, size_t bytes, const std::filesystem::path& outPath)
+{
+    while (bytes > 0) {
+        ssize_t n = ::write(fd, data, bytes);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("Failed writing to output file: " + outPath.string());
+        data  += n;
+        bytes -= static_cast<size_t>(n);
+    }
+}
+#endif
+
+// Copies blocks [start, start+count) of the image into a new host file.
+// Only positional reads are used (kernel copy, the mapping, or readAt), so
+// several threads may extract from one device at once.  With an
+// asynchronous `io` the copy is only queued; the file is complete once the
+// queue has been drained.
+void copyExtentToFile(BlockDevice& dev,
+                      uint32_t start,
+                      uint32_t count,
+                      const std::filesystem::path& outPath,
+                      IoQueue* io)
+{
+#ifndef _WIN32
+    if (io && io->async() && dev.fd() >= 0) {
+        int out = ::open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out < 0) throw std::runtime_error("Cannot create output file: " + outPath.string());
+        io->adopt(out, "output file: " + outPath.string());
+        io->copy(dev.fd(), static_cast<uint64_t>(start) * BLOCK_SIZE, out, 0,
+                 static_cast<uint64_t>(count) * BLOCK_SIZE);
+        return;
+    }
+#endif
+
+    std::vector<uint8_t> buf;
+
+    // Returns `n` blocks at `block`: straight from memory when the image is
+    // mapped, otherwise read into buf.
+    auto fetch = [&](uint32_t block, uint32_t& n) -> const uint8_t* {
+        if (dev.inMemory()) return dev.view(block, n);
+        n = std::min(n, COPY_CHUNK_BLOCKS);
+        buf.resize(static_cast<size_t>(n) * BLOCK_SIZE);
+        dev.readAt(block, n, buf.data());
+        return buf.data();
+    };
+
+#ifdef __linux__
+    // RT-11 files are contiguous, so the whole extent is handed to the kernel
+    // in one go when the image has a descriptor. Anything it could not copy
+    // is written from the device instead.
+    int out = ::open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) throw std::runtime_error("Cannot create output file: " + outPath.string());
+    try {
+        size_t bytes = static_cast<size_t>(count) * BLOCK_SIZE;
+        size_t done = 0;
+        if (dev.fd() >= 0) {
+            done = kernelCopy(dev.fd(), static_cast<uint64_t>(start) * BLOCK_SIZE, out, bytes);
+        }
+
+        while (done < bytes) {
+            uint32_t block = start + static_cast<uint32_t>(done / BLOCK_SIZE);
+            size_t skip = done % BLOCK_SIZE;
+            uint32_t n = count - (block - start);
+            const uint8_t* data = fetch(block, n);
+            size_t len = static_cast<size_t>(n) * BLOCK_SIZE - skip;
+            writeAll(out, data + skip, len, outPath);
+            done += len;
+        }
+    } catch (...) {
+        ::close(out);
+        throw;
+    }
+    if (::close(out) != 0) throw std::runtime_error("Failed writing to output file: " + outPath.string());
+#else
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot create output file: " + outPath.string());
+
+    uint32_t block = start;
+    uint32_t left  = count;
+    while (left > 0) {
+        uint32_t n = left;
+        const uint8_t* data = fetch(block, n);
+        out.write(reinterpret_cast<const char*>(data),
+                  static_cast<std::streamsize>(n) * BLOCK_SIZE);
+        if (!out.good()) throw std::runtime_error("Failed writing to output file: " + outPath.string());
+        block += n;
+        left  -= n;
+    }
+#endif
+}
+
+void copySingleFromRt11(BlockDevice& dev,
+                        const Rt11Entry& e,
+                        const std::filesystem::path& outPath,
+                        bool noReplace,
+                        std::ostream& log,
+                        IoQueue* io)
+{
+    if (!e.permanent()) {
+        throw std::runtime_error("Cannot copy non-permanent file: " + e.name());
+    }
+
+    uint32_t endBlock = static_cast<uint32_t>(e.startBlock) + e.lengthBlocks - 1;
+    if (e.startBlock == 0 || endBlock >= dev.totalBlocks()) {
+        throw Rt11Error(rt11::Error::BadDirectory, "RT-11 entry has invalid range; cannot copy " + e.name());
+    }
+
+    if (noReplace && std::filesystem::exists(outPath)) {
+        log << "Skipping " << outPath.string()
+            << "  already exists (noreplace)\n";
+        return;
+    }
+
+    copyExtentToFile(dev, e.startBlock, e.lengthBlocks, outPath, io);
+
+    log << "Copied " << e.name() << " -> " << outPath.string() << "\n";
+}
+
+// Extracts `matches` on a pool of `jobs` threads. Entries that map to the
+// same host file stay on one thread in directory order, and console output
+// is printed in directory order as results come in. A failure stops the
+// extraction of entries after it in directory order; every entry before it
+// is still extracted and logged, as on the serial path, and so are later
+// ones already extracted. The earliest failure is rethrown once the pool
+// has drained.
+void copyFromRt11Parallel(BlockDevice& dev,
+                          const std::vector<const Rt11Entry*>& matches,
+                          const std::filesystem::path& destDir,
+                          bool noReplace,
+                          unsigned jobs,
+                          std::ostream& log)
+{
+    std::vector<std::vector<size_t>> groups;
+    std::map<std::string, size_t> groupOf;
+    for (size_t i = 0; i < matches.size(); ++i) {
+        std::string key = (destDir / matches[i]->name()).string();
+        auto it = groupOf.find(key);
+        if (it == groupOf.end()) {
+            groupOf[key] = groups.size();
+            groups.push_back({i});
+        } else {
+            groups[it->second].push_back(i);
+        }
+    }
+
+    std::vector<std::string> output(matches.size());
+    std::vector<std::exception_ptr> errors(matches.size());
+    std::vector<bool> finished(matches.size(), false);
+    std::vector<bool> extracted(matches.size(), false);
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<size_t> nextGroup{0};
+    std::atomic<size_t> failedAt{SIZE_MAX};   // lowest failing index so far
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t g = nextGroup++;
+            if (g >= groups.size()) return;
+
+            for (size_t i : groups[g]) {
+                std::ostringstream fileLog;
+                std::exception_ptr err;
+                bool done = false;
+                if (i < failedAt) {
+                    try {
+                        copySingleFromRt11(dev, *matches[i], destDir / matches[i]->name(), noReplace, fileLog);
+                        done = true;
+                    } catch (...) {
+                        err = std::current_exception();
+                        size_t cur = failedAt;
+                        while (i < cur && !failedAt.compare_exchange_weak(cur, i)) {}
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    output[i]    = fileLog.str();
+                    errors[i]    = err;
+                    extracted[i] = done;
+                    finished[i]  = true;
+                }
+                cv.notify_all();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(jobs, groups.size()));
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(worker);
+
+    // Entries before the earliest failure are never skipped, so the first
+    // error met in directory order is that failure
+    size_t i = 0;
+    for (; i < matches.size(); ++i) {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&] { return finished[i]; });
+        if (errors[i]) break;
+        log << output[i] << std::flush;
+    }
+
+    for (auto& t : pool) t.join();
+    if (i < matches.size()) {
+        for (size_t j = i + 1; j < matches.size(); ++j) {
+            if (extracted[j]) log << output[j];
+        }
+        log << std::flush;
+        std::rethrow_exception(errors[i]);
+    }
+}
+
+// Copies every permanent file of `entries` matched by `patterns` in one
+// pass over the directory; an empty set selects all files.
+void copyFromEntries(BlockCache& cache,
+                     const std::vector<Rt11Entry>& entries,
+                     const Rt11PatternSet& patterns,
+                     const std::string& toPathRaw,
+                     bool noReplace,
+                     unsigned jobs,
+                     std::ostream& log,
+                     bool asyncIo)
+{
+    Rt11PatternSet selection = patterns;
+    if (selection.empty()) selection.include("*.*");
+
+    std::filesystem::path destDir;
+    if (toPathRaw.empty()) {
+        destDir = std::filesystem::current_path();
+    } else {
+        std::string p = toPathRaw;
+        if (hasWildcard(p)) {
+            auto pos = p.find_last_of("\\/");
+            if (pos != std::string::npos) p = p.substr(0, pos);
+        }
+        if (p.empty()) destDir = std::filesystem::current_path();
+        else          destDir = p;
+    }
+
+    std::vector<const Rt11Entry*> matches;
+    for (const auto& e : entries) {
+        if (e.permanent() && selection.matches(e)) {
+            matches.push_back(&e);
+        }
+    }
+
+    if (matches.empty()) {
+        throw std::runtime_error("No RT-11 files matched pattern: " + selection.describe());
+    }
+
+    // File data is read from the device directly, so it must be current
+    cache.syncExtent(0, cache.totalBlocks());
+
+    // With /io:uring every extent is queued and one ring copies the whole
+    // selection, so /jobs is not needed.  The log is held back until the
+    // data is written, and a host name that comes round again waits for the
+    // earlier copy so the later entry still wins, as in the loop below.
+    if (asyncIo && cache.device().fd() >= 0) {
+        IoQueue io;
+        if (io.async()) {
+            std::ostringstream pending;
+            std::set<std::filesystem::path> queued;
+            try {
+                for (const auto* e : matches) {
+                    std::filesystem::path outPath = destDir / e->name();
+                    if (!queued.insert(outPath).second) {
+                        io.drain();
+                        log << pending.str();
+                        pending.str("");
+                        queued = {outPath};
+                    }
+                    copySingleFromRt11(cache.device(), *e, outPath, noReplace, pending, &io);
+                }
+            } catch (...) {
+                // Finish what was queued before the failure, as the loop below would have
+                try {
+                    io.drain();
+                    log << pending.str();
+                } catch (...) {
+                }
+                throw;
+            }
+            io.drain();
+            log << pending.str();
+            return;
+        }
+    }
+
+    if (jobs > 1 && matches.size() > 1) {
+        copyFromRt11Parallel(cache.device(), matches, destDir, noReplace, jobs, log);
+        return;
+    }
+
+    for (const auto* e : matches) {
+        std::filesystem::path outPath = destDir / e->name();
+        copySingleFromRt11(cache.device(), *e, outPath, noReplace, log);
+    }
+}
+
+void copyFromRt11(BlockCache& cache,
+                  const std::string& imagePath,
+                  const Rt11PatternSet& patterns,
+                  const std::string& toPathRaw,
+                  bool noReplace,
+                  unsigned jobs,
+                  bool useIndex,
+                  bool asyncIo)
+{
+    std::vector<Rt11Entry> entries;
+    if (useIndex) readDirectoryIndexed(cache, imagePath, entries);
+    else          readDirectory(cache, entries);
+    copyFromEntries(cache, entries, patterns, toPathRaw, noReplace, jobs, std::cout, asyncIo);
+}
+
+// ------------------------------
+// Windows wildcard matching and expansion (for /copyto)
+// ------------------------------
+bool matchFsName(const std::string& name, const std::string& pattern) {
+    size_t n = 0, p = 0, star = std::string::npos, match = 0;
+
+    while (n < name.size()) {
+        if (p < pattern.size() &&
+            (pattern[p] == '?' ||
+             std::toupper(static_cast<unsigned char>(pattern[p])) ==
+             std::toupper(static_cast<unsigned char>(name[n])))) {
+            ++n;
+            ++p;
+        }
+        else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            match = n;
+        }
+        else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++match;
+        }
+        else {
+            return false;
+        }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
+
+bool hasFsWildcard(const std::string& s) {
+    return s.find('*') != std::string::npos || s.find('?') != std::string::npos;
+}
+
+std::vector<std::filesystem::path> expandWindowsWildcard(const std::string& pattern) {
+    std::filesystem::path p(pattern);
+    std::filesystem::path dir = p.parent_path();
+    std::string pat = p.filename().string();
+
+    if (dir.empty()) {
+        dir = std::filesystem::current_path();
+    }
+
+    std::vector<std::filesystem::path> result;
+
+    for (auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (!entry.is_regular_file()) continue;
+        auto name = entry.path().filename().string();
+        if (matchFsName(name, pat)) {
+            result.push_back(entry.path());
+        }
+    }
+
+    return result;
+}
+
+// ------------------------------
+// Free space index and allocation policies (for /copyto)
+// ------------------------------
+bool parseAllocPolicy(const std::string& s, AllocPolicy& policy) {
+    std::string p = normalizePattern(s);
+    if      (p == "FIRST") policy = AllocPolicy::FirstFit;
+    else if (p == "BEST")  policy = AllocPolicy::BestFit;
+    else if (p == "WORST") policy = AllocPolicy::WorstFit;
+    else if (p == "RT11")  policy = AllocPolicy::Rt11;
+    else return false;
+    return true;
+}
+
+void printFreeSpace(const char* label, const FreeExtentIndex& index, std::ostream& out) {
+    double frag = index.totalFree() == 0 ? 0.0
+                : 100.0 * (1.0 - static_cast<double>(index.largest()) / index.totalFree());
+    out << label << ": " << index.totalFree() << " free blocks in "
+        << index.count() << " areas, largest " << index.largest()
+        << " (fragmentation " << std::fixed << std::setprecision(1) << frag
+        << std::defaultfloat << "%)\n";
+}
+
+// ------------------------------
+// In-memory directory (for /copyto)
+// ------------------------------
+void loadDirectoryImage(BlockCache& cache, DirectoryImage& dir)
+{
+    dir.firstDirBlock = getFirstDirectoryBlock(cache);
+    if (dir.firstDirBlock + 1 >= cache.totalBlocks()) {
+        throw Rt11Error(rt11::Error::BadDirectory, "First directory block out of range");
+    }
+
+    dir.segs.clear();
+    uint16_t totalSegments = 1;
+    for (uint16_t s = 1; s <= totalSegments; ++s) {
+        uint32_t segBlock = dir.firstDirBlock + (s - 1) * DIR_SEGMENT_BLOCKS;
+        if (segBlock + 1 >= cache.totalBlocks()) break;
+
+        const uint8_t* buf0 = cache.read(segBlock);
+        const uint8_t* buf1 = cache.read(segBlock + 1);
+
+        std::array<uint16_t, 512> words;
+        unpackWords(buf0, words.data(), 256);
+        unpackWords(buf1, words.data() + 256, 256);
+        dir.segs.push_back(words);
+
+        if (s == 1 && words[0] >= 1 && words[0] <= 31) {
+            totalSegments = words[0];
+            cache.prefetch(segBlock, std::min<uint32_t>(totalSegments * DIR_SEGMENT_BLOCKS,
+                                                        cache.totalBlocks() - segBlock));
+        }
+    }
+    dir.dirty.assign(dir.segs.size(), false);
+}
+
+// Writes the segments changed since loadDirectoryImage() into the cache.
+void storeDirectoryImage(BlockCache& cache, DirectoryImage& dir)
+{
+    uint8_t segOut[DIR_SEGMENT_BLOCKS * BLOCK_SIZE];
+    for (uint16_t s = 1; s <= dir.segmentCount(); ++s) {
+        if (!dir.dirty[s - 1]) continue;
+
+        packWords(dir.words(s), segOut, 512);
+
+        cache.write(dir.firstDirBlock + (s - 1) * DIR_SEGMENT_BLOCKS, segOut, DIR_SEGMENT_BLOCKS);
+        dir.dirty[s - 1] = false;
+    }
+}
+
+// Same walk as readDirectory(), but over the in-memory segments.  A broken
+// chain is an error here since the result is about to be written back.
+void listDirectoryImage(const DirectoryImage& dir, std::vector<Rt11Entry>& entries)
+{
+    entries.clear();
+
+    uint32_t dataStartBlock = dir.words(1)[4];
+    uint32_t offset = 0;
+    std::vector<bool> visited(dir.segmentCount() + 1, false);
+
+    uint16_t seg = 1;
+    while (seg != 0) {
+        if (seg > dir.segmentCount()) {
+            throw Rt11Error(rt11::Error::BadDirectory, "Invalid segment number " + std::to_string(seg) +
+                                                       " in directory chain");
+        }
+        if (visited[seg]) throw Rt11Error(rt11::Error::BadDirectory, "Directory link loop detected");
+        visited[seg] = true;
+
+        seg = parseSegmentEntries(dir.words(seg), seg, dataStartBlock, offset, entries);
+    }
+}
+
+// readDirectory() for sweeps over many images: a broken segment chain
+// throws BadDirectory instead of a warning without the image's name and a
+// listing cut short.
+void readDirectoryStrict(BlockCache& cache, std::vector<Rt11Entry>& entries)
+{
+    DirectoryImage dir;
+    loadDirectoryImage(cache, dir);
+    listDirectoryImage(dir, entries);
+}
+
+void splitDirectorySegment(DirectoryImage& dir, uint16_t segToSplit)
+{
+    // 1) Read segment 1 header
+    DirSegmentHeader seg1Hdr = parseSegmentHeader(dir.words(1));
+
+    uint16_t totalSegments = seg1Hdr.totalSegments;   // word 0
+    if (totalSegments == 0 || totalSegments > 31)
+        throw Rt11Error(rt11::Error::BadDirectory, "Invalid totalSegments in directory header");
+    totalSegments = std::min(totalSegments, dir.segmentCount());
+
+    // 2) Build set of segments that are currently linked/in use
+    std::vector<bool> used(totalSegments + 1, false); // 1..totalSegments
+
+    // Blocks covered by the first `count` entries of a segment, stopping at EOS
+    uint16_t entryWords = 7 + seg1Hdr.extraBytes / 2;
+    auto entryBlocks = [entryWords](const uint16_t* w, size_t count) {
+        uint32_t blocks = 0;
+        for (uint16_t i = 5; count > 0 && i + entryWords <= 512; i = static_cast<uint16_t>(i + entryWords), --count) {
+            if ((w[i] & E_EOS) || w[i] == 0) break;
+            blocks += w[i + 4];
+        }
+        return blocks;
+    };
+
+    // Follow the link chain starting at segment 1, adding up where the
+    // files of segToSplit start on the volume
+    uint32_t splitStart   = seg1Hdr.dataStartBlock;
+    bool     reachedSplit = false;
+    uint16_t currentSeg = 1;
+    while (currentSeg != 0 && currentSeg >= 1 && currentSeg <= totalSegments) {
+        if (used[currentSeg]) {
+            // Loop in directory links  corrupt disk
+            throw Rt11Error(rt11::Error::BadDirectory, "Directory link loop detected while splitting");
+        }
+        used[currentSeg] = true;
+        if (currentSeg == segToSplit) reachedSplit = true;
+        if (!reachedSplit) splitStart += entryBlocks(dir.words(currentSeg), SIZE_MAX);
+
+        uint16_t nextSeg = dir.words(currentSeg)[1]; // header word 1 = link to next logical segment
+        currentSeg = nextSeg;
+    }
+
+    // At this point, "used[s]" = true iff segment "s" is in the directory chain.
+    // We are going to split segToSplit, so it must be in the chain:
+    if (segToSplit < 1 || segToSplit > totalSegments || !used[segToSplit]) {
+        throw Rt11Error(rt11::Error::BadDirectory, "Attempted to split a segment not in the directory chain");
+    }
+
+    // 3) Find an unused segment number we can use as the new segment
+    uint16_t newSegNum = 0;
+    for (uint16_t s = 1; s <= totalSegments; ++s) {
+        if (!used[s]) {
+            newSegNum = s;
+            break;
+        }
+    }
+    if (newSegNum == 0) {
+        // All segments 1..totalSegments are already in the chain; no place to split
+        throw Rt11Error(rt11::Error::DirectoryFull, "Directory full: no more segments available to split into");
+    }
+
+    // 4) Take a copy of the segment we are splitting
+    uint16_t words[512];
+    std::copy(dir.words(segToSplit), dir.words(segToSplit) + 512, words);
+
+    // 5) Collect indices of all directory entries in this segment (excluding EOS)
+    std::vector<uint16_t> entryIdx;
+    uint16_t idx = 5;
+    while (idx + entryWords <= 512) {
+        uint16_t st = words[idx + 0];
+        
+        // Stop at EOS marker (E_EOS bit set)
+        if (st & E_EOS) {
+            break;
+        }
+        
+        // Skip if status is 0 (shouldn't happen but be defensive)
+        if (st == 0) {
+            break;
+        }
+        
+        entryIdx.push_back(idx);
+        idx = static_cast<uint16_t>(idx + entryWords);
+    }
+    
+    if (entryIdx.empty()) {
+        throw Rt11Error(rt11::Error::BadDirectory, "Attempted to split an empty directory segment");
+    }
+
+    // 6) Choose a permanent/tentative entry near the middle as the split point
+    // We want to split on a file entry, not an empty entry if possible
+    std::vector<size_t> movablePositions;
+    for (size_t i = 0; i < entryIdx.size(); ++i) {
+        uint16_t st = words[entryIdx[i] + 0];
+        // Only split at permanent or tentative files, not empty areas
+        if (st & (E_PERM | E_TENT)) {
+            movablePositions.push_back(i);
+        }
+    }
+    
+    size_t midPos;
+    if (!movablePositions.empty()) {
+        // Split at the middle of file entries
+        midPos = movablePositions[movablePositions.size() / 2];
+    } else {
+        // No file entries, just split in the middle
+        midPos = entryIdx.size() / 2;
+    }
+
+    // Ensure we're not splitting at the last entry (need at least one entry in new segment)
+    if (midPos >= entryIdx.size() - 1) {
+        midPos = entryIdx.size() / 2;
+    }
+
+    uint16_t middleIdx      = entryIdx[midPos];
+    uint16_t originalLink   = words[1]; // old link to "next segment" from this header
+
+    // 7) The old segment keeps the entries before the middle, gets an EOS at
+    //    the split point and links to newSegNum
+    uint16_t* oldSegWords = dir.words(segToSplit);
+    oldSegWords[middleIdx + 0] = E_EOS;      // EOS at split point
+    oldSegWords[1]             = newSegNum;  // link current segment to new segment
+    oldSegWords[4]             = static_cast<uint16_t>(splitStart);
+    dir.dirty[segToSplit - 1]  = true;
+
+    // 8) Build the new segment: copy header, restore original link,
+    //    move entries from middle..end to the top
+    uint16_t* newWords = dir.words(newSegNum);
+    std::fill(newWords, newWords + 512, 0);
+
+    // Header: copy from original segment header (words[0..4]),
+    // but word 1 (link) should be the original link
+    newWords[0] = words[0];          // total segments
+    newWords[1] = originalLink;      // link restored (to next segment after this one)
+    newWords[2] = words[2];          // "highestInUse" is tracked only in seg 1
+    newWords[3] = words[3];          // extra bytes
+    newWords[4] = static_cast<uint16_t>(splitStart + entryBlocks(words, midPos));
+                                     // start block of its first entry
+
+    size_t entriesMoved = 0;
+    for (size_t i = midPos; i < entryIdx.size(); ++i) {
+        uint16_t srcIdxEntry  = entryIdx[i];
+        uint16_t destIdxEntry = static_cast<uint16_t>(5 + entriesMoved * entryWords);
+        if (destIdxEntry + entryWords > 512) {
+            break;
+        }
+
+        for (uint16_t w = 0; w < entryWords; ++w) {
+            newWords[destIdxEntry + w] = words[srcIdxEntry + w];
+        }
+        ++entriesMoved;
+    }
+
+    // Place EOS in the new segment at first free slot
+    uint16_t newEosIdx = static_cast<uint16_t>(5 + entriesMoved * entryWords);
+    if (newEosIdx < 512) {
+        newWords[newEosIdx + 0] = E_EOS;
+    }
+    dir.dirty[newSegNum - 1] = true;
+
+    // 9) Update "highest segment in use" in segment 1 header (word 2)
+    // RT-11 ignores this in other segments.
+    uint16_t oldHighest = seg1Hdr.highestInUse;
+    uint16_t newHighest = std::max<uint16_t>(oldHighest, newSegNum);
+    
+    if (newHighest != oldHighest) {
+        dir.words(1)[2] = newHighest;
+        dir.dirty[0]    = true;
+    }
+}
+
+// Turns the empty entry at `idx` into a permanent file of `blocks` blocks,
+// inserting a new empty entry for whatever is left over.  Returns false,
+// leaving the segment untouched, if the segment has no room for that entry.
+bool allocateInSegment(uint16_t* words,
+                       uint16_t idx,
+                       const std::string& rtname,
+                       uint16_t blocks,
+                       uint16_t dateW)
+{
+    DirSegmentHeader hdr = parseSegmentHeader(words);
+    uint16_t extraWordsSeg = hdr.extraBytes / 2;
+    uint16_t entryWordsSeg = 7 + extraWordsSeg;
+
+    uint16_t originalLen = words[idx + 4];
+
+    if (originalLen < blocks) {
+        throw std::runtime_error("Internal error: chosen empty area smaller than required");
+    }
+
+    uint16_t remaining = static_cast<uint16_t>(originalLen - blocks);
+
+    // PRE-CHECK: Calculate how much space we need
+    // We need space for: the new file entry (already exists as empty)
+    // Plus potentially: new empty entry + new EOS
+    // Find current EOS position
+    uint16_t eosIdx = 0;
+    uint16_t scanIdx = 5;
+    while (scanIdx + entryWordsSeg <= 512) {
+        uint16_t st = words[scanIdx + 0];
+        if (st & E_EOS) {
+            eosIdx = scanIdx;
+            break;
+        }
+        if (st == 0) {
+            eosIdx = scanIdx;
+            break;
+        }
+        scanIdx = static_cast<uint16_t>(scanIdx + entryWordsSeg);
+    }
+    if (eosIdx == 0) eosIdx = scanIdx;
+
+    // If we have remaining space, we'll need to insert a new empty entry
+    // Check if there's room for: [entries up to EOS] + [new empty entry] + [EOS]
+    if (remaining > 0) {
+        uint16_t spaceNeededAfterInsert = static_cast<uint16_t>(eosIdx + entryWordsSeg + entryWordsSeg);
+        
+        if (spaceNeededAfterInsert > 512) {
+            return false;
+        }
+    }
+
+    // Now proceed with the actual directory update
+    uint16_t status = E_PERM;
+    uint16_t name1, name2, ext;
+    encodeFileName(rtname, name1, name2, ext);
+    uint16_t jobCh = 0;
+
+    words[idx + 0] = status;
+    words[idx + 1] = name1;
+    words[idx + 2] = name2;
+    words[idx + 3] = ext;
+    words[idx + 4] = blocks;
+    words[idx + 5] = jobCh;
+    words[idx + 6] = dateW;
+
+    if (remaining > 0) {
+        uint16_t insertIdx = static_cast<uint16_t>(idx + entryWordsSeg);
+
+        // If insertIdx < eosIdx, we need to shift entries to make room
+        if (insertIdx < eosIdx) {
+            // Shift entries UP to make room for the new empty entry
+            for (int i = eosIdx - 1; i >= static_cast<int>(insertIdx); --i) {
+                words[i + entryWordsSeg] = words[i];
+            }
+        }
+
+        // Insert the new empty entry at insertIdx
+        words[insertIdx + 0] = E_MPTY;
+        words[insertIdx + 1] = 0;
+        words[insertIdx + 2] = 0;
+        words[insertIdx + 3] = 0;
+        words[insertIdx + 4] = remaining;
+        words[insertIdx + 5] = 0;
+        words[insertIdx + 6] = 0;
+        
+        // Place the EOS marker after the last (possibly shifted) entry
+        uint16_t newEosIdx = static_cast<uint16_t>(eosIdx + entryWordsSeg);
+        
+        // Clear all words for the new EOS entry
+        for (uint16_t w = 0; w < entryWordsSeg; ++w) {
+            words[newEosIdx + w] = 0;
+        }
+        words[newEosIdx] = E_EOS;
+    }
+
+    return true;
+}
+
+// ------------------------------
+// Copy TO RT-11 (Windows -> RT-11)
+// ------------------------------
+// Enters a permanent file of `blocks` blocks in the in-memory directory,
+// splitting segments as needed, and returns its start block.  Nothing is
+// written to the image.
+uint32_t allocateFile(DirectoryImage& dir,
+                      uint32_t totalBlocks,
+                      const std::string& rtname,
+                      uint32_t blocks,
+                      uint16_t dateW,
+                      AllocPolicy policy)
+{
+    if (blocks == 0 || blocks > 0xFFFF) {
+        throw Rt11Error(rt11::Error::NoSpace, "File too large for an RT-11 volume: " + rtname);
+    }
+
+    for (;;) {
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+
+        long chosen = FreeExtentIndex(entries).choose(blocks, policy);
+        if (chosen < 0) throw Rt11Error(rt11::Error::NoSpace, "No empty area large enough found for allocation");
+        const Rt11Entry emptyEntry = entries[static_cast<size_t>(chosen)];
+
+        uint32_t start = emptyEntry.startBlock;
+        uint32_t endBlock = start + blocks - 1;
+        if (start == 0 || endBlock >= totalBlocks) {
+            throw Rt11Error(rt11::Error::BadDirectory, "Selected empty area has invalid range on disk");
+        }
+
+        if (!allocateInSegment(dir.words(emptyEntry.segNumber), emptyEntry.wordIndex,
+                               rtname, static_cast<uint16_t>(blocks), dateW)) {
+            // No room for the leftover empty entry: split and search again
+            splitDirectorySegment(dir, emptyEntry.segNumber);
+            continue;
+        }
+        dir.dirty[emptyEntry.segNumber - 1] = true;
+        return start;
+    }
+}
+
+// Allocates space for one host file in the in-memory directory.  Returns
+// false if the file is skipped because of /noreplace.
+bool planCopyToRt11(DirectoryImage& dir,
+                    uint32_t totalBlocks,
+                    const std::filesystem::path& srcPath,
+                    bool noReplace,
+                    uint16_t dateW,
+                    AllocPolicy policy,
+                    CopyPlan& plan,
+                    std::ostream& log)
+{
+    if (!std::filesystem::exists(srcPath)) {
+        throw std::runtime_error("Source file does not exist: " + srcPath.string());
+    }
+
+    std::string baseName = srcPath.filename().string();
+    std::string rtname = normalizeRt11Name(baseName);
+
+    uintmax_t bytes = std::filesystem::file_size(srcPath);
+    uintmax_t blocksNeeded = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocksNeeded == 0) blocksNeeded = 1;
+    if (blocksNeeded > 0xFFFF) {
+        throw Rt11Error(rt11::Error::NoSpace, "File too large for an RT-11 volume: " + srcPath.string());
+    }
+
+    if (noReplace) {
+        uint16_t rad50[3];
+        encodeFileName(rtname, rad50[0], rad50[1], rad50[2]);
+
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+        for (const auto& e : entries) {
+            if (e.permanent() && std::equal(rad50, rad50 + 3, e.rad50)) {
+                log << "Skipping " << rtname
+                    << "  already exists on RT-11 (noreplace)\n";
+                return false;
+            }
+        }
+    }
+
+    plan.srcPath    = srcPath;
+    plan.rtname     = rtname;
+    plan.bytes      = bytes;
+    plan.blocks     = static_cast<uint32_t>(blocksNeeded);
+    plan.startBlock = allocateFile(dir, totalBlocks, rtname, plan.blocks, dateW, policy);
+    return true;
+}
+
+// Streams one planned file into its allocated blocks, a chunk at a time.
+// Only the final partial block is zero-padded.  With an asynchronous `io`
+// the data is only queued and lands once the queue has been drained.
+void copySingleToRt11(BlockCache& cache, const CopyPlan& plan, IoQueue* io)
+{
+#ifndef _WIN32
+    BlockDevice& dev = cache.device();
+    if (io && io->async() && dev.fd() >= 0) {
+        int in = ::open(plan.srcPath.c_str(), O_RDONLY);
+        if (in < 0) throw std::runtime_error("Cannot open input file: " + plan.srcPath.string());
+        io->adopt(in, plan.srcPath.string());
+
+        struct stat st;
+        if (::fstat(in, &st) != 0 || static_cast<uintmax_t>(st.st_size) != plan.bytes) {
+            throw std::runtime_error("Input file changed size while copying: " + plan.srcPath.string());
+        }
+
+        // The ring writes only the data bytes, so the last block is cleared
+        // first to get its padding; cached copies of the extent go stale.
+        if (plan.bytes % BLOCK_SIZE != 0 || plan.bytes == 0) {
+            uint8_t zero[BLOCK_SIZE] = {};
+            cache.writeExtent(plan.startBlock + plan.blocks - 1, zero, 1);
+        }
+        cache.discardExtent(plan.startBlock, plan.blocks);
+        io->copy(in, 0, dev.fd(), static_cast<uint64_t>(plan.startBlock) * BLOCK_SIZE, plan.bytes);
+        return;
+    }
+#endif
+
+    std::ifstream in(plan.srcPath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open input file: " + plan.srcPath.string());
+
+    std::vector<uint8_t> buf(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+    uintmax_t bytesLeft = plan.bytes;
+    uint32_t block = plan.startBlock;
+    uint32_t left  = plan.blocks;
+    while (left > 0) {
+        uint32_t n = std::min(left, COPY_CHUNK_BLOCKS);
+        size_t chunkBytes = static_cast<size_t>(n) * BLOCK_SIZE;
+        size_t toRead = static_cast<size_t>(std::min<uintmax_t>(bytesLeft, chunkBytes));
+
+        if (toRead > 0) {
+            in.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(toRead));
+            if (static_cast<size_t>(in.gcount()) != toRead) {
+                throw std::runtime_error("Input file changed size while copying: " + plan.srcPath.string());
+            }
+        }
+        if (toRead < chunkBytes) {
+            std::memset(buf.data() + toRead, 0, chunkBytes - toRead);
+        }
+
+        cache.writeExtent(block, buf.data(), n);
+        bytesLeft -= toRead;
+        block += n;
+        left  -= n;
+    }
+
+    if (in.peek() != std::char_traits<char>::eof()) {
+        throw std::runtime_error("Input file changed size while copying: " + plan.srcPath.string());
+    }
+}
+
+// Copies a batch of host files in one pass: the directory is read once,
+// every allocation is planned in memory, file data is written in ascending
+// block order, and the directory is committed once at the end.  A failure
+// while planning leaves the image untouched.
+void copyToRt11(BlockCache& cache,
+                const std::string& imagePath,
+                const std::string& fromPatternRaw,
+                bool noReplace,
+                uint16_t optionalDateWord,
+                AllocPolicy policy,
+                bool reportFreeSpace,
+                std::ostream& log,
+                bool asyncIo)
+{
+    if (fromPatternRaw.empty()) {
+        throw std::runtime_error("/from requires a filename or wildcard");
+    }
+
+    std::vector<std::filesystem::path> srcFiles;
+
+    if (hasFsWildcard(fromPatternRaw)) {
+        srcFiles = expandWindowsWildcard(fromPatternRaw);
+        if (srcFiles.empty()) {
+            throw std::runtime_error("No Windows files matched pattern: " + fromPatternRaw);
+        }
+    } else {
+        std::filesystem::path p(fromPatternRaw);
+        if (!std::filesystem::exists(p) || !std::filesystem::is_regular_file(p)) {
+            throw std::runtime_error("Source file does not exist: " + p.string());
+        }
+        srcFiles.push_back(p);
+    }
+
+    DirectoryImage dir;
+    loadDirectoryImage(cache, dir);
+
+    std::vector<Rt11Entry> entries;
+    if (reportFreeSpace) {
+        listDirectoryImage(dir, entries);
+        printFreeSpace("Free space before", FreeExtentIndex(entries), log);
+    }
+
+    // Use optional date if provided, otherwise use system date
+    uint16_t dateW = (optionalDateWord != 0) ? optionalDateWord : encodeRt11DateFromSystem();
+
+    std::vector<CopyPlan> plans;
+    for (const auto& p : srcFiles) {
+        CopyPlan plan;
+        if (planCopyToRt11(dir, cache.totalBlocks(), p, noReplace, dateW, policy, plan, log)) {
+            plans.push_back(plan);
+        }
+    }
+
+    if (reportFreeSpace) {
+        listDirectoryImage(dir, entries);
+        printFreeSpace("Free space after", FreeExtentIndex(entries), log);
+    }
+
+    std::vector<const CopyPlan*> order;
+    for (const auto& plan : plans) order.push_back(&plan);
+    std::sort(order.begin(), order.end(),
+              [](const CopyPlan* a, const CopyPlan* b) { return a->startBlock < b->startBlock; });
+
+    std::unique_ptr<IoQueue> io;
+    if (asyncIo) {
+        io = std::make_unique<IoQueue>();
+        if (!io->async()) io.reset();
+    }
+    for (const auto* plan : order) {
+        copySingleToRt11(cache, *plan, io.get());
+    }
+    if (io) io->drain();
+
+    storeDirectoryImage(cache, dir);
+    cache.flush();
+
+    for (const auto& plan : plans) {
+        log << "Copied " << plan.srcPath.string() << " -> " << plan.rtname
+            << " on " << imagePath << "\n";
+    }
+}
+
+// ------------------------------
+// Squeeze (compact the volume)
+// ------------------------------
+// Moves `count` blocks from `from` down to `to` (to < from) in large
+// sequential chunks.  Each chunk is read completely before it is written,
+// and the destination never runs ahead of the source, so overlapping moves
+// are safe.
+void moveBlocksDown(BlockCache& cache, uint32_t from, uint32_t to, uint32_t count)
+{
+    std::vector<uint8_t> buf(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+    while (count > 0) {
+        uint32_t n = std::min(count, COPY_CHUNK_BLOCKS);
+        std::memcpy(buf.data(), cache.readExtent(from, n), static_cast<size_t>(n) * BLOCK_SIZE);
+        cache.writeExtent(to, buf.data(), n);
+        from  += n;
+        to    += n;
+        count -= n;
+    }
+}
+
+// Slides every permanent file down over the empty areas in one pass and
+// rebuilds the directory with all free space in a single trailing empty
+// area.  As in RT-11, files with a .BAD extension cover bad blocks and stay
+// where they are; the free space in front of each one is kept as an empty
+// area.  Tentative entries are treated as free space.  The new directory is
+// planned and checked to fit before any file is moved.
+void squeezeVolume(BlockCache& cache, const std::string& imagePath)
+{
+    DirectoryImage dir;
+    loadDirectoryImage(cache, dir);
+
+    std::vector<Rt11Entry> entries;
+    listDirectoryImage(dir, entries);
+    printFreeSpace("Free space before", FreeExtentIndex(entries));
+
+    DirSegmentHeader hdr = parseSegmentHeader(dir.words(1));
+    uint16_t totalSegments = std::min(hdr.totalSegments, dir.segmentCount());
+    uint16_t extraWords    = hdr.extraBytes / 2;
+    uint16_t entryWords    = 7 + extraWords;
+    uint16_t perSegment    = static_cast<uint16_t>((512 - 5 - 1) / entryWords);  // room left for EOS
+
+    uint32_t dataStart = hdr.dataStartBlock;
+    uint32_t dataEnd   = dataStart;
+    for (const auto& e : entries) {
+        dataEnd = std::max<uint32_t>(dataEnd, static_cast<uint32_t>(e.startBlock) + e.lengthBlocks);
+    }
+    if (dataEnd > cache.totalBlocks()) {
+        throw Rt11Error(rt11::Error::BadDirectory, "Directory describes blocks beyond the end of the image");
+    }
+
+    // New entry list, in address order
+    std::vector<std::vector<uint16_t>> packed;
+    auto addEmpty = [&](uint32_t blocks) {
+        std::vector<uint16_t> w(entryWords, 0);
+        w[0] = E_MPTY;
+        w[4] = static_cast<uint16_t>(blocks);
+        packed.push_back(w);
+    };
+
+    // Moves of adjacent files by the same distance are merged into one run
+    struct MoveRun { uint32_t from, to, count; };
+    std::vector<MoveRun> runs;
+    uint32_t filesMoved = 0, blocksMoved = 0;
+
+    uint32_t cursor = dataStart;
+    for (const auto& e : entries) {
+        if (!e.permanent()) continue;
+
+        const uint16_t* src = dir.words(e.segNumber) + e.wordIndex;
+        uint32_t start = e.startBlock;
+
+        if (decodeRad50(e.rad50[2]) == "BAD") {
+            if (start > cursor) addEmpty(start - cursor);
+            cursor = start;
+        } else if (start != cursor && e.lengthBlocks > 0) {
+            if (!runs.empty() && runs.back().from + runs.back().count == start &&
+                runs.back().to + runs.back().count == cursor) {
+                runs.back().count += e.lengthBlocks;
+            } else {
+                runs.push_back({start, cursor, e.lengthBlocks});
+            }
+            ++filesMoved;
+            blocksMoved += e.lengthBlocks;
+        }
+
+        packed.emplace_back(src, src + entryWords);
+        cursor += e.lengthBlocks;
+    }
+    if (dataEnd > cursor) addEmpty(dataEnd - cursor);
+
+    // The old directory must stay valid until the new one is sure to fit
+    size_t segsNeeded = std::max<size_t>(1, (packed.size() + perSegment - 1) / perSegment);
+    if (segsNeeded > totalSegments) {
+        throw std::runtime_error("Squeezed directory does not fit in " +
+                                 std::to_string(totalSegments) + " segments");
+    }
+
+    for (const auto& run : runs) moveBlocksDown(cache, run.from, run.to, run.count);
+
+    // Rebuild the segments, packed full from segment 1 on
+
+    uint32_t segStart = dataStart;
+    size_t next = 0;
+    for (uint16_t s = 1; s <= segsNeeded; ++s) {
+        uint16_t* words = dir.words(s);
+        std::fill(words + 1, words + 512, static_cast<uint16_t>(0));
+        words[0] = hdr.totalSegments;
+        words[1] = (s < segsNeeded) ? static_cast<uint16_t>(s + 1) : 0;
+        words[2] = (s == 1) ? static_cast<uint16_t>(segsNeeded) : 0;
+        words[3] = hdr.extraBytes;
+        words[4] = static_cast<uint16_t>(segStart);
+
+        uint16_t idx = 5;
+        for (uint16_t k = 0; k < perSegment && next < packed.size(); ++k, ++next) {
+            std::copy(packed[next].begin(), packed[next].end(), words + idx);
+            segStart += packed[next][4];
+            idx = static_cast<uint16_t>(idx + entryWords);
+        }
+        words[idx] = E_EOS;
+        dir.dirty[s - 1] = true;
+    }
+
+    storeDirectoryImage(cache, dir);
+    cache.flush();
+
+    listDirectoryImage(dir, entries);
+    printFreeSpace("Free space after", FreeExtentIndex(entries));
+    std::cout << "Squeezed " << imagePath << ": " << filesMoved << " files moved ("
+              << blocksMoved << " blocks), directory uses " << segsNeeded << " of "
+              << totalSegments << " segments\n";
+}
+
+// ------------------------------
+// Overlays (/overlay, /commit, /flatten)
+// ------------------------------
+// Writes every block of the delta into the image, then deletes the delta.
+// The delta stays until the image has been synced, so an interrupted
+// commit can simply be run again.
+void commitOverlay(const std::string& imagePath, const std::string& overlayPath, std::ostream& log)
+{
+    if (!std::filesystem::exists(overlayPath)) {
+        throw std::runtime_error("Overlay not found: " + overlayPath);
+    }
+
+    BlockDevice delta(imagePath, false, overlayPath);
+    std::vector<uint32_t> blocks = delta.overlayBlocks();
+    {
+        BlockDevice image(imagePath, true);
+        std::vector<uint8_t> buf(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+        for (size_t i = 0; i < blocks.size(); ) {
+            // Runs of adjacent blocks move together
+            uint32_t n = 1;
+            while (i + n < blocks.size() && n < COPY_CHUNK_BLOCKS && blocks[i + n] == blocks[i] + n) ++n;
+            delta.readAt(blocks[i], n, buf.data());
+            image.writeBlocks(blocks[i], buf.data(), n);
+            i += n;
+        }
+        image.sync();
+
+        BlockCache cache(image);
+        refreshDirectoryIndex(cache, imagePath, false);
+    }
+    std::filesystem::remove(overlayPath);
+
+    log << "Committed " << blocks.size() << " blocks from " << overlayPath
+        << " to " << imagePath << "\n";
+}
+
+// Writes the image as seen through the delta to a new standalone image.
+void flattenOverlay(const std::string& imagePath,
+                    const std::string& overlayPath,
+                    const std::string& outPath,
+                    std::ostream& log)
+{
+    if (!std::filesystem::exists(overlayPath)) {
+        throw std::runtime_error("Overlay not found: " + overlayPath);
+    }
+    std::error_code ec;
+    if (std::filesystem::equivalent(imagePath, outPath, ec) || std::filesystem::equivalent(overlayPath, outPath, ec)) {
+        throw std::runtime_error("/flatten needs a new file, not the image or the overlay: " + outPath);
+    }
+
+    BlockDevice delta(imagePath, false, overlayPath);
+    std::string tmp = outPath + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("Cannot create output file: " + outPath);
+
+        std::vector<uint8_t> buf(static_cast<size_t>(COPY_CHUNK_BLOCKS) * BLOCK_SIZE);
+        for (uint32_t b = 0; b < delta.totalBlocks(); ) {
+            uint32_t n = std::min(COPY_CHUNK_BLOCKS, delta.totalBlocks() - b);
+            delta.readAt(b, n, buf.data());
+            out.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(n) * BLOCK_SIZE);
+            b += n;
+        }
+        if (!out.flush()) {
+            out.close();
+            std::filesystem::remove(tmp, ec);
+            throw std::runtime_error("Failed writing to output file: " + outPath);
+        }
+    }
+    std::filesystem::rename(tmp, outPath);
+
+    log << "Flattened " << imagePath << " with " << overlayPath << " (" << delta.overlayBlocks().size()
+        << " blocks changed) -> " << outPath << "\n";
+}
+
+// ------------------------------
+// Volume verify (/verify)
+// ------------------------------
+size_t VerifyReport::errors() const {
+    return static_cast<size_t>(std::count_if(issues.begin(), issues.end(),
+                                             [](const VerifyIssue& i) { return i.error; }));
+}
+
+void addVerifyIssue(std::vector<VerifyIssue>& issues, bool error, const char* check,
+                    uint16_t segment, const std::string& message)
+{
+    VerifyIssue issue;
+    issue.error   = error;
+    issue.check   = check;
+    issue.segment = segment;
+    issue.message = message;
+    issues.push_back(std::move(issue));
+}
+
+// What can be said about one segment without looking at any other.
+struct SegmentCheck {
+    std::vector<VerifyIssue> issues;
+    uint32_t blocks = 0;    // sum of its entry lengths
+    uint32_t files = 0;
+    uint32_t used = 0;
+    uint32_t free = 0;
+};
+
+void verifySegment(const uint16_t* words, uint16_t segNum, uint16_t extraBytes, SegmentCheck& out)
+{
+    DirSegmentHeader hdr = parseSegmentHeader(words);
+    if (hdr.extraBytes != extraBytes) {
+        addVerifyIssue(out.issues, true, "header", segNum,
+                       "extra bytes per entry " + std::to_string(hdr.extraBytes) +
+                       " differ from segment 1 (" + std::to_string(extraBytes) + ")");
+    }
+    if (hdr.extraBytes & 1) {
+        addVerifyIssue(out.issues, true, "header", segNum,
+                       "odd extra bytes per entry: " + std::to_string(hdr.extraBytes));
+    }
+
+    const uint32_t entryWords = 7u + hdr.extraBytes / 2u;
+    bool ended = false;
+    for (uint32_t idx = 5; idx < 512; idx += entryWords) {
+        uint16_t status = words[idx];
+        if (status & E_EOS) {
+            ended = true;
+            break;
+        }
+        if (idx + entryWords > 512) break;
+
+        // Exactly one of the kind bits; readDirectory() stops at anything else
+        uint16_t kind = status & (E_TENT | E_MPTY | E_PERM);
+        if (kind != E_TENT && kind != E_MPTY && kind != E_PERM) {
+            addVerifyIssue(out.issues, true, "entry", segNum,
+                           "word " + std::to_string(idx) + ": bad status word " + octalWord(status) +
+                           "; later entries are lost");
+            ended = true;
+            break;
+        }
+
+        uint16_t len = words[idx + 4];
+        out.blocks += len;
+        if (kind == E_MPTY) {
+            out.free += len;
+            continue;
+        }
+
+        std::string name = decodeFileName(words[idx + 1], words[idx + 2], words[idx + 3]);
+        if (kind == E_TENT) {
+            addVerifyIssue(out.issues, false, "entry", segNum,
+                           "tentative file " + name + " (" + std::to_string(len) +
+                           " blocks) left by an interrupted write");
+            continue;
+        }
+        ++out.files;
+        out.used += len;
+        // Three RAD50 characters encode to at most 050*050*050 - 1
+        if (words[idx + 1] >= 64000 || words[idx + 2] >= 64000 || words[idx + 3] >= 64000) {
+            addVerifyIssue(out.issues, false, "entry", segNum,
+                           "word " + std::to_string(idx) + ": file name " + name + " is not valid RAD50");
+        }
+    }
+    if (!ended) {
+        addVerifyIssue(out.issues, true, "entry", segNum, "no end-of-segment marker");
+    }
+}
+
+// Checks the fields of a home block against a volume of
+// report.totalBlocks blocks.  A checksum of 0 was never written (images
+// made by other tools rarely have one) and is only a warning; any other
+// wrong checksum is an error.  Returns whether the directory it points to
+// is on the volume.
+bool verifyHomeBlock(const uint16_t* home, VerifyReport& r)
+{
+    uint16_t stored = home[HOME_CHECKSUM_WORD];
+    uint16_t sum = homeBlockChecksum(home);
+    if (stored != sum) {
+        addVerifyIssue(r.issues, stored != 0, "home", 0,
+                       "checksum at octal 776 is " + octalWord(stored) +
+                       ", words 0-254 sum to " + octalWord(sum));
+    }
+    if (home[233] == 0) {
+        addVerifyIssue(r.issues, false, "home", 0, "pack cluster size at octal 722 is 0");
+    }
+    if (home[234] == 0) {
+        addVerifyIssue(r.issues, false, "home", 0, "first directory block at octal 724 is 0; block 6 is used");
+    }
+    uint32_t firstDirBlock = getFirstDirectoryBlock(home);
+    if (firstDirBlock < 2 || firstDirBlock + DIR_SEGMENT_BLOCKS > r.totalBlocks) {
+        addVerifyIssue(r.issues, true, "home", 0,
+                       "first directory block " + std::to_string(firstDirBlock) + " is not on the volume");
+        return false;
+    }
+    return true;
+}
+
+// Checks the home block, the segment chain, every segment in it and the
+// extents they describe.  Segments are checked on up to `jobs` threads from
+// one in-memory copy of the directory; what depends on their order (data
+// start words, coverage of the volume) is checked afterwards along the
+// chain.  Damage is reported, never repaired.  With `homeOnly` the
+// directory is not read.
+VerifyReport verifyVolume(BlockCache& cache, unsigned jobs, bool homeOnly)
+{
+    VerifyReport r;
+    r.totalBlocks = cache.totalBlocks();
+    if (r.totalBlocks < 2) {
+        addVerifyIssue(r.issues, true, "home", 0,
+                       "volume of " + std::to_string(r.totalBlocks) + " blocks has no home block");
+        return r;
+    }
+
+    uint16_t home[256];
+    readHomeBlock(cache, home);
+    if (!verifyHomeBlock(home, r) || homeOnly) return r;
+    uint32_t firstDirBlock = getFirstDirectoryBlock(home);
+
+    DirectoryImage dir;
+    loadDirectoryImage(cache, dir);
+    DirSegmentHeader first = parseSegmentHeader(dir.words(1));
+    uint16_t declared = first.totalSegments;
+    if (declared == 0 || declared > 31) {
+        addVerifyIssue(r.issues, true, "header", 1,
+                       "total segments " + std::to_string(declared) + " is not 1-31");
+        declared = dir.segmentCount();
+    } else if (dir.segmentCount() < declared) {
+        addVerifyIssue(r.issues, true, "header", 1,
+                       std::to_string(declared) + " segments run past the end of the volume");
+    }
+
+    // Chain of links from segment 1
+    std::vector<uint16_t> chain;
+    std::vector<bool> seen(dir.segmentCount() + 1, false);
+    for (uint16_t seg = 1; seg != 0; ) {
+        if (seg > dir.segmentCount()) {
+            addVerifyIssue(r.issues, true, "chain", chain.back(),
+                           "link to segment " + std::to_string(seg) + ", directory has " +
+                           std::to_string(dir.segmentCount()));
+            break;
+        }
+        if (seen[seg]) {
+            addVerifyIssue(r.issues, true, "chain", chain.back(),
+                           "link back to segment " + std::to_string(seg) + " makes a loop");
+            break;
+        }
+        seen[seg] = true;
+        chain.push_back(seg);
+        seg = dir.words(seg)[1];
+    }
+    r.segments = static_cast<uint16_t>(chain.size());
+
+    uint16_t highest = *std::max_element(chain.begin(), chain.end());
+    if (first.highestInUse != highest) {
+        addVerifyIssue(r.issues, true, "chain", 1,
+                       "highest segment in use is " + std::to_string(first.highestInUse) +
+                       ", the chain reaches segment " + std::to_string(highest));
+    }
+
+    // Segments on their own
+    std::vector<SegmentCheck> checks(chain.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < chain.size(); i = next++) {
+            verifySegment(dir.words(chain[i]), chain[i], first.extraBytes, checks[i]);
+        }
+    };
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(std::max(1u, jobs), chain.size()));
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+
+    // Extents, in chain order
+    uint32_t dirEnd = firstDirBlock + static_cast<uint32_t>(declared) * DIR_SEGMENT_BLOCKS;
+    uint32_t dataStart = first.dataStartBlock;
+    if (dataStart < dirEnd) {
+        addVerifyIssue(r.issues, true, "extent", 1,
+                       "data starts at block " + std::to_string(dataStart) +
+                       ", inside the directory (blocks " + std::to_string(firstDirBlock) + "-" +
+                       std::to_string(dirEnd - 1) + ")");
+    } else if (dataStart > dirEnd) {
+        addVerifyIssue(r.issues, false, "extent", 1,
+                       "data starts at block " + std::to_string(dataStart) + ", " +
+                       std::to_string(dataStart - dirEnd) + " blocks after the directory");
+    }
+
+    uint64_t pos = dataStart;
+    for (size_t i = 0; i < chain.size(); ++i) {
+        // RT-11 keeps the start of the segment's first file in word 4
+        uint16_t segStart = dir.words(chain[i])[4];
+        if (i > 0 && segStart != pos) {
+            addVerifyIssue(r.issues, false, "header", chain[i],
+                           "data start word is " + std::to_string(segStart) +
+                           ", its first entry starts at block " + std::to_string(pos));
+        }
+        for (auto& issue : checks[i].issues) r.issues.push_back(std::move(issue));
+        pos += checks[i].blocks;
+        r.files      += checks[i].files;
+        r.usedBlocks += checks[i].used;
+        r.freeBlocks += checks[i].free;
+    }
+
+    if (pos > r.totalBlocks) {
+        addVerifyIssue(r.issues, true, "extent", 0,
+                       "entries end at block " + std::to_string(pos) + ", past the end of the volume (" +
+                       std::to_string(r.totalBlocks) + " blocks)");
+    } else if (pos < r.totalBlocks) {
+        addVerifyIssue(r.issues, false, "extent", 0,
+                       "blocks " + std::to_string(pos) + "-" + std::to_string(r.totalBlocks - 1) +
+                       " are not in any directory entry");
+    }
+    return r;
+}
+
+// Home block check of an image file with a single 512-byte read and no
+// mapping, for sweeps over many images.  A pending journal is not
+// replayed, so this reads what is on the disk right now.
+VerifyReport verifyHomeBlockFile(const std::string& imagePath)
+{
+    VerifyReport r;
+    std::ifstream in(imagePath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open disk image: " + imagePath);
+    r.totalBlocks = static_cast<uint32_t>(std::filesystem::file_size(imagePath) / BLOCK_SIZE);
+    if (r.totalBlocks < 2) {
+        addVerifyIssue(r.issues, true, "home", 0,
+                       "volume of " + std::to_string(r.totalBlocks) + " blocks has no home block");
+        return r;
+    }
+
+    uint8_t buf[BLOCK_SIZE];
+    in.seekg(static_cast<std::streamoff>(BLOCK_SIZE));
+    if (!in.read(reinterpret_cast<char*>(buf), BLOCK_SIZE)) {
+        throw std::runtime_error("Cannot read the home block of " + imagePath);
+    }
+    uint16_t home[256];
+    unpackWords(buf, home, 256);
+    verifyHomeBlock(home, r);
+    return r;
+}
+
+static const char VERIFY_CSV_HEADER[] = "image,severity,check,segment,message\n";
+
+// One record per issue and one result record per image.  In text, the
+// result line comes first and the issues are indented under it.
+void appendVerifyRecords(std::string& buf, ListFormat format, const std::string& image, const VerifyReport& r)
+{
+    size_t errors = r.errors();
+    const char* result = errors == 0 ? "ok" : "failed";
+
+    if (format == ListFormat::Text) {
+        buf += image;
+        buf += errors == 0 ? ": OK (" : ": FAILED (";
+        appendNumber(buf, errors);        buf += " errors, ";
+        appendNumber(buf, r.warnings());  buf += " warnings";
+        if (r.segments != 0) {
+            buf += "; ";
+            appendNumber(buf, r.segments);    buf += " segments, ";
+            appendNumber(buf, r.files);       buf += " files, ";
+            appendNumber(buf, r.usedBlocks);  buf += " used and ";
+            appendNumber(buf, r.freeBlocks);  buf += " free of ";
+            appendNumber(buf, r.totalBlocks); buf += " blocks";
+        }
+        buf += ")\n";
+        for (const auto& i : r.issues) {
+            buf += i.error ? "  error   " : "  warning ";
+            buf += i.check;
+            if (i.segment != 0) {
+                buf += ", segment ";
+                appendNumber(buf, i.segment);
+            }
+            buf += ": ";
+            buf += i.message;
+            buf.push_back('\n');
+        }
+        return;
+    }
+
+    for (const auto& i : r.issues) {
+        if (format == ListFormat::Jsonl) {
+            buf += "{\"image\":";
+            appendJsonString(buf, image);
+            buf += ",\"severity\":\"";
+            buf += i.error ? "error" : "warning";
+            buf += "\",\"check\":\"";
+            buf += i.check;
+            buf += "\",\"segment\":";     appendNumber(buf, i.segment);
+            buf += ",\"message\":";
+            appendJsonString(buf, i.message);
+            buf += "}\n";
+        } else {
+            appendCsvField(buf, image);
+            buf += i.error ? ",error," : ",warning,";
+            buf += i.check;
+            buf.push_back(','); appendNumber(buf, i.segment);
+            buf.push_back(','); appendCsvField(buf, i.message);
+            buf.push_back('\n');
+        }
+    }
+
+    if (format == ListFormat::Jsonl) {
+        buf += "{\"image\":";
+        appendJsonString(buf, image);
+        buf += ",\"result\":\"";
+        buf += result;
+        buf += "\",\"errors\":";      appendNumber(buf, errors);
+        buf += ",\"warnings\":";      appendNumber(buf, r.warnings());
+        buf += ",\"segments\":";      appendNumber(buf, r.segments);
+        buf += ",\"files\":";         appendNumber(buf, r.files);
+        buf += ",\"used\":";          appendNumber(buf, r.usedBlocks);
+        buf += ",\"free\":";          appendNumber(buf, r.freeBlocks);
+        buf += ",\"blocks\":";        appendNumber(buf, r.totalBlocks);
+        buf += "}\n";
+    } else {
+        appendCsvField(buf, image);
+        buf += ",result,";
+        buf += result;
+        buf += ",0,";
+        appendNumber(buf, errors);
+        buf += " errors ";
+        appendNumber(buf, r.warnings());
+        buf += " warnings\n";
+    }
+}
+
+void writeVerifyReport(std::ostream& out, const std::string& image, const VerifyReport& report, ListFormat format)
+{
+    std::string buf;
+    if (format == ListFormat::Csv) buf += VERIFY_CSV_HEADER;
+    appendVerifyRecords(buf, format, image, report);
+    out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+}
+
+// Verifies every image under `root` on `jobs` threads, one image per
+// thread, and returns how many failed.  With `homeOnly` only the home
+// block of each image is read.  An image that cannot be opened fails with
+// an "open" error.  Reports appear in completion order.
+size_t verifyImages(const std::string& root, unsigned jobs, ListFormat format, bool homeOnly)
+{
+    std::vector<std::filesystem::path> images = findImages(root);
+    if (images.empty()) throw std::runtime_error("No disk images found under " + root);
+
+    std::mutex outMutex;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failed{0};
+
+    auto worker = [&]() {
+        std::string buf;
+        for (size_t i = next++; i < images.size(); i = next++) {
+            std::string image = images[i].string();
+            VerifyReport report;
+            try {
+                if (homeOnly) {
+                    report = verifyHomeBlockFile(image);
+                } else {
+                    BlockDevice dev(image, false);
+                    BlockCache cache(dev);
+                    report = verifyVolume(cache, 1);
+                }
+            } catch (const std::exception& ex) {
+                report = VerifyReport();
+                addVerifyIssue(report.issues, true, "open", 0, ex.what());
+            }
+            if (report.errors() != 0) ++failed;
+
+            buf.clear();
+            appendVerifyRecords(buf, format, image, report);
+            std::lock_guard<std::mutex> lock(outMutex);
+            std::cout.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        }
+    };
+
+    if (format == ListFormat::Csv) std::cout << VERIFY_CSV_HEADER;
+
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(std::max(1u, jobs), images.size()));
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    std::cout << std::flush;
+
+    std::ostream& summary = (format == ListFormat::Text) ? std::cout : std::cerr;
+    summary << (format == ListFormat::Text ? "\n" : "")
+            << "Images: " << images.size() - failed << " passed, " << failed << " failed\n";
+    return failed;
+}
@@ -0,0 +1,1049 @@
+// rt11engine.h - directory, copy and volume primitives shared by the
+// rt11dir front end, rt11bench and the Volume API (rt11.h).
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rt11.h"
+
+// ------------------------------
+// Errors
+// ------------------------------
+// Failures the Volume API reports by code carry it; anything else is a
+// plain std::runtime_error and comes back as rt11::Error::Failed.
+class Rt11Error : public std::runtime_error {
+public:
+    Rt11Error(rt11::Error code, const std::string& message)
+        : std::runtime_error(message), code_(code) {}
+
+    rt11::Error code() const { return code_; }
+
+private:
+    rt11::Error code_;
+};
+
+// ------------------------------
+// Constants
+// ------------------------------
+static constexpr size_t   BLOCK_SIZE         = 512; // 256 words * 2 bytes
+static constexpr uint32_t DIR_SEGMENT_BLOCKS = 2;   // 2 blocks per directory segment
+static constexpr uint32_t COPY_CHUNK_BLOCKS  = 128; // file data moved per I/O call
+static constexpr size_t   OUTPUT_BUFFER_BYTES = 64 * 1024; // listing records per write
+
+// Status word bits
+static constexpr uint16_t E_TENT = 0x0100;
+static constexpr uint16_t E_MPTY = 0x0200;
+static constexpr uint16_t E_PERM = 0x0400;
+static constexpr uint16_t E_EOS  = 0x0800;
+static constexpr uint16_t E_READ = 0x4000;
+static constexpr uint16_t E_PRE  = 0x8000;
+
+static const char RAD50_TABLE[40] = {
+    ' ', 'A','B','C','D','E','F','G','H','I',
+    'J','K','L','M','N','O','P','Q','R','S',
+    'T','U','V','W','X','Y','Z',
+    '$','.', '%','0','1','2','3','4','5','6','7','8','9'
+};
+
+// ------------------------------
+// Types
+// ------------------------------
+// Directory entry as stored on disk: the name stays in RAD50 and is only
+// decoded (name()) when it has to be shown or matched as text.
+struct Rt11Entry {
+    uint16_t status = 0;
+    uint16_t rad50[3] = {0, 0, 0};  // name1, name2, ext
+    uint16_t startBlock = 0;
+    uint16_t lengthBlocks = 0;
+    uint16_t dateWord = 0;
+
+    uint16_t segNumber = 0; // 1-based logical segment number
+    uint16_t wordIndex = 0; // index in words[] of status word
+
+    bool tentative() const { return (status & E_TENT) != 0; }
+    bool empty() const     { return (status & E_MPTY) != 0; }
+    bool permanent() const { return (status & E_PERM) != 0; }
+
+    std::string name() const;   // NAME.EXT (upper-case)
+};
+
+// Column view of a directory, for whole-volume scans that only look at
+// status, length and start (totals, free-space searches).
+struct DirectoryColumns {
+    std::vector<uint16_t> status;
+    std::vector<uint16_t> lengthBlocks;
+    std::vector<uint16_t> startBlock;
+
+    explicit DirectoryColumns(const std::vector<Rt11Entry>& entries) {
+        status.reserve(entries.size());
+        lengthBlocks.reserve(entries.size());
+        startBlock.reserve(entries.size());
+        for (const auto& e : entries) {
+            status.push_back(e.status);
+            lengthBlocks.push_back(e.lengthBlocks);
+            startBlock.push_back(e.startBlock);
+        }
+    }
+
+    size_t size() const { return status.size(); }
+};
+
+struct DirSegmentHeader {
+    uint16_t totalSegments;
+    uint16_t nextSegment;
+    uint16_t highestInUse;
+    uint16_t extraBytes;
+    uint16_t dataStartBlock;
+};
+
+// ------------------------------
+// Block device
+// ------------------------------
+// Regular image files are memory-mapped, so block reads hand back pointers
+// straight into the mapping.  Other seekable descriptors (block devices,
+// files that cannot be mapped) use pread/pwrite, which carry their own
+// offset, so threads share the descriptor without a lock.  Windows builds go
+// through an fstream under a mutex; a non-seekable input is read into memory
+// once and served from there.
+//
+// With an overlay (/overlay) the image is only read: written blocks go to a
+// copy-on-write delta file, and reads of blocks not in the delta fall
+// through to the image.  The delta is a 512-byte header (magic, image size)
+// followed by records of a u32 block number and the block's data; a block
+// written again is rewritten in its record.  While an overlay is in use the
+// device offers no descriptor and no views, so nothing reads the image
+// behind the delta's back.
+class BlockDevice {
+public:
+    // One buffer of a vectored transfer: `count` whole blocks at `data`
+    struct Span {
+        uint8_t* data;
+        uint32_t count;
+    };
+
+    // A writable device with an overlay creates the delta if it is missing;
+    // a read-only one treats a missing delta as empty.
+    BlockDevice(const std::string& path, bool writable, const std::string& overlayPath = std::string());
+    ~BlockDevice();
+
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+
+    uint32_t totalBlocks() const { return totalBlocks_; }
+    bool writable() const { return writable_; }
+    bool mapped() const { return map_ != nullptr && !overlay_; }
+    bool inMemory() const { return base_ != nullptr && !overlay_; }
+
+    // Blocks held by the overlay, in ascending order (none without one)
+    std::vector<uint32_t> overlayBlocks() const;
+
+    // Descriptor of the image, or -1 when going through the stream or an
+    // overlay.
+#ifndef _WIN32
+    int fd() const { return overlay_ ? -1 : fd_; }
+#else
+    int fd() const { return -1; }
+#endif
+
+    // View of `count` consecutive blocks starting at `block`. Views into a
+    // mapped or in-memory image stay valid for the life of the device;
+    // otherwise the view is in a buffer of the device's own, valid until the
+    // next call and not to be used from several threads.
+    const uint8_t* blocks(uint32_t block, uint32_t count = 1);
+
+    // Thread-safe reads and writes. view() is only available when
+    // inMemory().  The span forms move consecutive blocks starting at
+    // `block` to or from several buffers in one preadv/pwritev.
+    const uint8_t* view(uint32_t block, uint32_t count) const;
+    void readAt(uint32_t block, uint32_t count, uint8_t* out) const;
+    void readSpans(uint32_t block, const Span* spans, size_t n) const;
+
+    void writeBlocks(uint32_t block, const uint8_t* data, uint32_t count = 1);
+    void writeSpans(uint32_t block, const Span* spans, size_t n);
+    void flush();
+    // flush(), then waits until the image is on disk.  The stream path can
+    // only flush its buffers.
+    void sync();
+
+    // Writable image files commit directory changes through a redo journal
+    // (see BlockCache::flush()).
+    bool journaled() const { return journaled_; }
+    std::string journalPath() const;
+
+    // Exclusive advisory lock on the image (the delta with an overlay),
+    // held from writing a journal until removing it, so that no other
+    // process replays or deletes a journal still in flight.  Without
+    // `wait`, returns false at once if another process holds it.
+    bool lockJournal(bool wait);
+    void unlockJournal();
+
+private:
+    struct Overlay;
+
+    bool openDescriptor();
+    void openStream();
+    void openOverlay(const std::string& overlayPath, bool writable);
+    void recoverJournal();
+    void release();
+    void readImage(uint32_t block, const Span* spans, size_t n) const;
+    void overlayTransfer(uint32_t block, const Span* spans, size_t n, bool write) const;
+    void checkRange(uint32_t block, uint32_t count, const char* op) const;
+    void streamTransfer(uint32_t block, const Span* spans, size_t n, bool write) const;
+
+    std::string path_;
+    bool writable_ = false;
+    bool journaled_ = false;
+    uint32_t totalBlocks_ = 0;
+
+    const uint8_t* base_ = nullptr;   // mapping or memory_, if any
+    uint8_t* map_ = nullptr;
+    size_t mapSize_ = 0;
+#ifndef _WIN32
+    int fd_ = -1;
+    int lockFd_ = -1;                 // holds lockJournal()'s lock
+#else
+    void* lockHandle_ = nullptr;      // HANDLE holding lockJournal()'s lock
+#endif
+
+    mutable std::fstream stream_;
+    mutable std::mutex streamMutex_;  // guards stream_
+    std::vector<uint8_t> memory_;     // whole image for non-seekable inputs
+    std::vector<uint8_t> buf_;        // blocks() buffer when not in memory
+    std::unique_ptr<Overlay> overlay_;
+};
+
+// ------------------------------
+// Block cache
+// ------------------------------
+// LRU cache of single blocks in front of a BlockDevice.  Directory and home
+// block traffic goes through read()/write(); writes are held as dirty blocks
+// until flush() (or eviction), so a segment rewritten several times during
+// one operation reaches the image once.  File data goes through
+// readExtent()/writeExtent(), which bypass the cache but stay coherent with
+// it.  The destructor does not flush: callers flush when an operation has
+// completed, so a failed operation leaves its directory changes unwritten.
+// On a journaled device dirty blocks are not evicted either; they all go
+// out together through the journal in flush().
+class BlockCache {
+public:
+    explicit BlockCache(BlockDevice& dev, size_t capacity = 128);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    BlockDevice& device() { return dev_; }
+    uint32_t totalBlocks() const { return dev_.totalBlocks(); }
+
+    // Cached single-block read. The pointer stays valid until `capacity`
+    // further distinct blocks have been touched.
+    const uint8_t* read(uint32_t block);
+    void write(uint32_t block, const uint8_t* data, uint32_t count = 1);
+
+    const uint8_t* readExtent(uint32_t block, uint32_t count);
+    void writeExtent(uint32_t block, const uint8_t* data, uint32_t count);
+
+    // Loads the blocks in one gathered read, for a range that is about to
+    // be read block by block.  Ranges larger than the cache are ignored.
+    void prefetch(uint32_t block, uint32_t count);
+    // Forgets cached copies in the range after it was written behind the
+    // cache's back (dirty blocks there should have been synced first).
+    void discardExtent(uint32_t block, uint32_t count);
+
+    // Writes back dirty blocks in the range so the device itself is current,
+    // for callers that read the image behind the cache's back.
+    void syncExtent(uint32_t block, uint32_t count) { writeBackRange(block, count); }
+
+    void flush();
+
+    uint64_t hits() const       { return hits_; }
+    uint64_t misses() const     { return misses_; }
+    uint64_t writebacks() const { return writebacks_; }
+
+private:
+    struct Slot {
+        uint32_t block = 0;
+        bool dirty = false;
+        uint8_t data[BLOCK_SIZE];
+    };
+
+    Slot& lookup(uint32_t block, bool load);
+    void writeBack(Slot& s);
+    void writeBackRange(uint32_t block, uint32_t count);
+
+    BlockDevice& dev_;
+    size_t capacity_;
+    std::list<Slot> lru_;   // most recently used first
+    std::unordered_map<uint32_t, std::list<Slot>::iterator> index_;
+
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t writebacks_ = 0;
+};
+
+void printCacheStats(const BlockCache& cache, std::ostream& out = std::cout);
+
+// ------------------------------
+// Directory journal (<image>.r11j)
+// ------------------------------
+// Redo journal of the directory blocks one flush() is about to write in
+// place.  Layout (little-endian): 8-byte magic, u64 image size, u32 block
+// count n, n u32 block numbers, n blocks of data, and an FNV-1a of all
+// that.  A journal that is torn, or belongs to an image of another size,
+// was never committed and is ignored.
+void writeJournal(const std::string& path,
+                  uint32_t totalBlocks,
+                  const std::vector<uint32_t>& blocks,
+                  const std::vector<const uint8_t*>& data);
+bool readJournal(const std::string& path,
+                 uint32_t totalBlocks,
+                 std::vector<uint32_t>& blocks,
+                 std::vector<uint8_t>& data);
+
+// ------------------------------
+// Asynchronous copy queue (io_uring)
+// ------------------------------
+// Descriptor-to-descriptor copies for /io:uring.  Queued copies are cut into
+// COPY_CHUNK_BLOCKS chunks; drain() submits each chunk as a read linked to a
+// write and keeps up to `depth` chunks in flight.  io_uring is driven through
+// its system calls, so there is no library dependency; async() is false
+// where it is not compiled in or the kernel refuses a ring, and callers then
+// take their synchronous path.  A chunk the ring does not finish in full is
+// redone with pread/pwrite, which also reports the real error if any.
+class IoQueue {
+public:
+    explicit IoQueue(unsigned depth = 32);
+    ~IoQueue();
+
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
+
+    bool async() const { return ring_ != nullptr; }
+
+    // Queues `bytes` from `inFd` at `inOffset` to `outFd` at `outOffset`.
+    void copy(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t bytes);
+    // Hands over a descriptor used by queued copies; drain() closes it.
+    void adopt(int fd, const std::string& name);
+    // Runs every queued copy and closes adopted descriptors, then throws the
+    // first failure, if any.
+    void drain();
+
+private:
+    struct Chunk {
+        int inFd;
+        uint64_t inOffset;
+        int outFd;
+        uint64_t outOffset;
+        uint32_t len;
+    };
+    struct Ring;
+
+    void runChunks();
+    void copyNow(const Chunk& c, uint8_t* buf);
+    void closeAdopted();
+
+    std::unique_ptr<Ring> ring_;
+    unsigned depth_;
+    std::vector<Chunk> pending_;
+    std::vector<std::pair<int, std::string>> adopted_;
+    std::vector<uint8_t> buffers_;    // depth_ chunk buffers
+};
+
+// ------------------------------
+// Word codec
+// ------------------------------
+// RT-11 stores 16-bit words low byte first.  On little-endian hosts that is
+// the in-memory layout already, so a block converts with one memcpy; on
+// big-endian hosts each word is byte-swapped in a plain loop the compiler
+// vectorizes.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RT11_BIG_ENDIAN 1
+#endif
+
+inline void unpackWords(const uint8_t* src, uint16_t* words, size_t count) {
+#ifdef RT11_BIG_ENDIAN
+    std::memcpy(words, src, count * 2);
+    for (size_t i = 0; i < count; ++i) words[i] = __builtin_bswap16(words[i]);
+#else
+    std::memcpy(words, src, count * 2);
+#endif
+}
+
+inline void packWords(const uint16_t* words, uint8_t* dst, size_t count) {
+#ifdef RT11_BIG_ENDIAN
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t w = __builtin_bswap16(words[i]);
+        std::memcpy(dst + 2 * i, &w, 2);
+    }
+#else
+    std::memcpy(dst, words, count * 2);
+#endif
+}
+
+// Little-endian fields of 1..8 bytes in the tool's own side files (journal,
+// directory index, overlay).
+inline uint64_t getLE(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+inline void putLE(uint8_t* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        p[i] = static_cast<uint8_t>(v & 0xFF);
+        v >>= 8;
+    }
+}
+
+// 64-bit FNV-1a.  Pass the previous result as h to hash several buffers as
+// one stream.
+inline uint64_t fnv1a(const uint8_t* p, size_t n, uint64_t h = 0xcbf29ce484222325ull) {
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// ------------------------------
+// RAD50 helpers
+// ------------------------------
+// Character -> RAD50 code, upper and lower case alike.  Characters outside
+// the RAD50 set encode as a space (0), as they always have.
+constexpr std::array<uint8_t, 256> makeRad50Index() {
+    std::array<uint8_t, 256> t{};
+    for (int i = 0; i < 40; ++i) {
+        unsigned char c = static_cast<unsigned char>(RAD50_TABLE[i]);
+        t[c] = static_cast<uint8_t>(i);
+        if (c >= 'A' && c <= 'Z') t[c - 'A' + 'a'] = static_cast<uint8_t>(i);
+    }
+    return t;
+}
+
+static constexpr std::array<uint8_t, 256> RAD50_INDEX = makeRad50Index();
+int rad50Index(char c);
+
+// Word -> its three characters with the spaces squeezed out, packed as
+// chars[0..2] plus the count in byte 3.  Words past the last valid code
+// (050*050*050) decode as '?'.
+struct Rad50Text {
+    char chars[3];
+    uint8_t len;
+};
+
+const Rad50Text* rad50DecodeTable();
+uint16_t encodeRad50(const std::string& s3);
+std::string decodeRad50(uint16_t w);
+size_t decodeFileNameTo(const Rad50Text* table, uint16_t name1, uint16_t name2, uint16_t ext,
+                        char* out);
+std::string decodeFileName(uint16_t name1, uint16_t name2, uint16_t ext);
+void decodeFileNames(const std::vector<Rt11Entry>& entries, std::vector<std::string>& names);
+void encodeFileName(const std::string& rtname,
+                    uint16_t& name1,
+                    uint16_t& name2,
+                    uint16_t& ext);
+void encodeFileNames(const std::vector<std::string>& names,
+                     std::vector<std::array<uint16_t, 3>>& rad50);
+
+// ------------------------------
+// RT-11 filename normalization (for /copyto)
+// ------------------------------
+std::string normalizeRt11Name(const std::string& name);
+
+// ------------------------------
+// RT-11 pattern matching (for /copyfrom)
+// ------------------------------
+std::string normalizePattern(const std::string& pattern);
+bool hasWildcard(const std::string& s);
+bool matchComponent(const std::string& value, const std::string& pattern);
+bool matchRt11Pattern(const std::string& rtName, const std::string& pattern);
+
+// A name's RAD50 fields split into digits, computed once per directory
+// entry and shared by every pattern it is tested against.
+struct Rt11NameDigits {
+    const uint16_t* rad50;
+    int8_t d[9];          // NAME in d[0..5], EXT in d[6..8]
+    uint8_t nameLen = 0;
+    uint8_t extLen  = 0;
+    bool canonical = true;
+
+    explicit Rt11NameDigits(const uint16_t words[3]) : rad50(words) {
+        for (int k = 0; k < 3; ++k) {
+            if (words[k] >= 40 * 40 * 40) canonical = false;
+            d[3*k]     = static_cast<int8_t>(words[k] / 1600);
+            d[3*k + 1] = static_cast<int8_t>((words[k] / 40) % 40);
+            d[3*k + 2] = static_cast<int8_t>(words[k] % 40);
+        }
+        while (nameLen < 6 && d[nameLen] != 0) ++nameLen;
+        while (extLen < 3 && d[6 + extLen] != 0) ++extLen;
+
+        // The decoded name is each field up to its first space only if the
+        // rest of the field is blank, and is split at its first '.', so
+        // names with a '.' before the extension need the string path too.
+        for (int i = nameLen; i < 6; ++i) if (d[i] != 0) canonical = false;
+        for (int i = extLen; i < 3; ++i) if (d[6 + i] != 0) canonical = false;
+        for (int i = 0; i < nameLen; ++i) if (d[i] == RAD50_INDEX['.']) canonical = false;
+    }
+};
+
+// One pattern compiled against RAD50 digits, so directory entries can be
+// selected without decoding them.  Matches exactly what matchRt11Pattern()
+// does on the decoded name.
+class Rt11PatternMatcher {
+public:
+    explicit Rt11PatternMatcher(const std::string& pattern)
+        : pattern_(normalizePattern(pattern))
+    {
+        auto dot = pattern_.find('.');
+        name_ = compile(pattern_.substr(0, dot), 6);
+        ext_  = compile(dot == std::string::npos ? "" : pattern_.substr(dot + 1), 3);
+    }
+
+    bool matches(const Rt11NameDigits& v) const {
+        return name_.matches(v.rad50, v.d, v.nameLen, 2) &&
+               ext_.matches(v.rad50 + 2, v.d + 6, v.extLen, 1);
+    }
+
+    const std::string& pattern() const { return pattern_; }
+
+    // Fully literal NAME.EXT (words in `rad50`)
+    bool exact(uint16_t rad50[3]) const {
+        if (!name_.literal || !ext_.literal) return false;
+        rad50[0] = name_.words[0];
+        rad50[1] = name_.words[1];
+        rad50[2] = ext_.words[0];
+        return true;
+    }
+
+    // *.EXT with a literal extension
+    bool anyNameExact(uint16_t& ext) const {
+        if (!name_.any || !ext_.literal) return false;
+        ext = ext_.words[0];
+        return true;
+    }
+
+    bool matchesAll() const { return name_.any && ext_.any; }
+
+private:
+    static constexpr int8_t ANY_CHAR = -1;   // '?'
+    static constexpr int8_t ANY_RUN  = -2;   // '*'
+
+    struct Component {
+        bool any = false;       // only stars, or empty: matches everything
+        bool never = false;     // cannot match any name
+        bool literal = false;   // no wildcards: compare words
+        uint16_t words[2] = {0, 0};
+        std::vector<int8_t> pat;
+
+        bool matches(const uint16_t* w, const int8_t* d, size_t len, int nwords) const {
+            if (any) return true;
+            if (never) return false;
+            if (literal) return w[0] == words[0] && (nwords == 1 || w[1] == words[1]);
+
+            // Same walk as matchComponent(), over digits
+            size_t n = 0, p = 0, star = SIZE_MAX, mark = 0;
+            while (n < len) {
+                if (p < pat.size() && (pat[p] == ANY_CHAR || pat[p] == d[n])) {
+                    ++p;
+                    ++n;
+                } else if (p < pat.size() && pat[p] == ANY_RUN) {
+                    star = p++;
+                    mark = n;
+                } else if (star != SIZE_MAX) {
+                    p = star + 1;
+                    n = ++mark;
+                } else {
+                    return false;
+                }
+            }
+            while (p < pat.size() && pat[p] == ANY_RUN) ++p;
+            return p == pat.size();
+        }
+    };
+
+    static Component compile(const std::string& p, int width) {
+        Component c;
+        if (p.find_first_not_of('*') == std::string::npos) { c.any = true; return c; }
+
+        size_t fixed = 0;
+        for (char ch : p) {
+            if (ch == '*') {
+                if (c.pat.empty() || c.pat.back() != ANY_RUN) c.pat.push_back(ANY_RUN);
+                continue;
+            }
+            ++fixed;
+            if (ch == '?') {
+                c.pat.push_back(ANY_CHAR);
+                continue;
+            }
+            // Decoded names never contain a space or a non-RAD50 character
+            int8_t digit = static_cast<int8_t>(RAD50_INDEX[static_cast<unsigned char>(ch)]);
+            if (digit == 0) { c.never = true; return c; }
+            c.pat.push_back(digit);
+        }
+        if (fixed > static_cast<size_t>(width)) { c.never = true; return c; }
+
+        if (p.find_first_of("*?") == std::string::npos) {
+            c.literal = true;
+            std::string padded = p + std::string(static_cast<size_t>(width) - p.size(), ' ');
+            c.words[0] = encodeRad50(padded.substr(0, 3));
+            if (width == 6) c.words[1] = encodeRad50(padded.substr(3, 3));
+        }
+        return c;
+    }
+
+    std::string pattern_;
+    Component name_;
+    Component ext_;
+};
+
+// Include and exclude patterns compiled into one set and tested together:
+// an entry is selected if any include matches and no exclude does.
+// Common shapes are answered by lookup instead of one test per pattern:
+// "*.*", fully literal names and "*.EXT".
+class Rt11PatternSet {
+public:
+    void include(const std::string& pattern) { add(includes_, pattern); }
+    void exclude(const std::string& pattern) { add(excludes_, pattern); }
+
+    bool empty() const { return includes_.patterns.empty(); }
+
+    bool matches(const uint16_t rad50[3]) const {
+        Rt11NameDigits v(rad50);
+        if (!v.canonical) {
+            std::string name = decodeFileName(rad50[0], rad50[1], rad50[2]);
+            return includes_.matches(name) && !excludes_.matches(name);
+        }
+        return includes_.matches(v) && !excludes_.matches(v);
+    }
+
+    bool matches(const Rt11Entry& e) const { return matches(e.rad50); }
+
+    // Patterns as given, for messages
+    std::string describe() const {
+        std::string s;
+        for (const auto& m : includes_.patterns) s += (s.empty() ? "" : ",") + m.pattern();
+        for (const auto& m : excludes_.patterns) s += " /exclude:" + m.pattern();
+        return s;
+    }
+
+private:
+    struct Group {
+        std::vector<Rt11PatternMatcher> patterns;   // all of them, for the string path
+        std::vector<Rt11PatternMatcher> general;    // those not covered below
+        std::vector<std::array<uint16_t, 3>> exact; // sorted
+        std::vector<uint16_t> anyNameExt;           // sorted
+        bool all = false;
+
+        bool matches(const Rt11NameDigits& v) const {
+            if (all) return true;
+            if (!exact.empty() &&
+                std::binary_search(exact.begin(), exact.end(),
+                                   std::array<uint16_t, 3>{v.rad50[0], v.rad50[1], v.rad50[2]})) {
+                return true;
+            }
+            if (!anyNameExt.empty() &&
+                std::binary_search(anyNameExt.begin(), anyNameExt.end(), v.rad50[2])) {
+                return true;
+            }
+            for (const auto& m : general) {
+                if (m.matches(v)) return true;
+            }
+            return false;
+        }
+
+        bool matches(const std::string& name) const {
+            for (const auto& m : patterns) {
+                if (matchRt11Pattern(name, m.pattern())) return true;
+            }
+            return false;
+        }
+    };
+
+    static void add(Group& g, const std::string& pattern) {
+        Rt11PatternMatcher m(pattern);
+        std::array<uint16_t, 3> words;
+        uint16_t ext;
+        if (m.matchesAll()) {
+            g.all = true;
+        } else if (m.exact(words.data())) {
+            g.exact.insert(std::upper_bound(g.exact.begin(), g.exact.end(), words), words);
+        } else if (m.anyNameExact(ext)) {
+            g.anyNameExt.insert(std::upper_bound(g.anyNameExt.begin(), g.anyNameExt.end(), ext), ext);
+        } else {
+            g.general.push_back(m);
+        }
+        g.patterns.push_back(m);
+    }
+
+    Group includes_;
+    Group excludes_;
+};
+
+std::vector<std::string> splitPatternList(const std::string& list);
+
+// ------------------------------
+// RT-11 date encode/decode
+// ------------------------------
+std::string formatRt11Date(uint16_t dateWord);
+uint16_t encodeRt11DateFromSystem();
+bool parseDateString(const std::string& dateStr, int& day, int& month, int& year);
+uint16_t encodeRt11Date(int year, int month, int day);
+
+// ------------------------------
+// Home block / first dir block
+// ------------------------------
+// Word 255 (octal 776) of the home block holds the 16-bit sum of words
+// 0-254.
+static constexpr int HOME_CHECKSUM_WORD = 255;
+uint16_t homeBlockChecksum(const uint16_t* words);
+std::string octalWord(uint16_t w);
+// Reads the home block into words[256]; returns whether its checksum holds.
+bool readHomeBlock(BlockCache& cache, uint16_t* words);
+uint32_t getFirstDirectoryBlock(const uint16_t* homeWords);
+uint32_t getFirstDirectoryBlock(BlockCache& cache);
+void checkBadBlockTable(BlockCache& cache);
+bool fixHomeBlock(BlockCache& cache, std::ostream& log = std::cout);
+
+// ------------------------------
+// Directory parsing
+// ------------------------------
+DirSegmentHeader parseSegmentHeader(const uint16_t* words);
+uint16_t parseSegmentEntries(const uint16_t* words,
+                             uint16_t segNum,
+                             uint32_t dataStartBlock,
+                             uint32_t& offset,
+                             std::vector<Rt11Entry>& entries);
+void readDirectory(BlockCache& cache, std::vector<Rt11Entry>& entries);
+
+// ------------------------------
+// Sidecar directory index (<image>.r11idx)
+// ------------------------------
+struct ImageStamp {
+    uint64_t size  = 0;
+    int64_t  mtime = 0;
+};
+
+std::string directoryIndexPath(const std::string& imagePath);
+bool imageStamp(const std::string& imagePath, ImageStamp& stamp);
+uint64_t hashDirectoryBlocks(BlockCache& cache);
+bool loadDirectoryIndex(const std::string& indexPath,
+                        ImageStamp& stamp,
+                        uint64_t& dirHash,
+                        std::vector<Rt11Entry>& entries);
+void saveDirectoryIndex(const std::string& indexPath,
+                        const ImageStamp& stamp,
+                        uint64_t dirHash,
+                        const std::vector<Rt11Entry>& entries);
+void readDirectoryIndexed(BlockCache& cache,
+                          const std::string& imagePath,
+                          std::vector<Rt11Entry>& entries,
+                          bool strict = false);
+void refreshDirectoryIndex(BlockCache& cache, const std::string& imagePath, bool create);
+
+// ------------------------------
+// Machine-readable listings (/format:jsonl, /format:csv)
+// ------------------------------
+enum class ListFormat { Text, Jsonl, Csv };
+bool parseListFormat(const std::string& s, ListFormat& format);
+const char* entryType(const Rt11Entry& e);
+void appendNumber(std::string& buf, uint64_t v);
+void appendJsonString(std::string& buf, const std::string& s);
+void appendCsvField(std::string& buf, const std::string& s);
+void appendEntryRecord(std::string& buf,
+                       ListFormat format,
+                       const std::string& image,
+                       const Rt11Entry& e,
+                       const std::string& name);
+void writeEntryRecords(std::ostream& out,
+                       ListFormat format,
+                       const std::string& image,
+                       const std::vector<Rt11Entry>& entries);
+
+// ------------------------------
+// Directory listing
+// ------------------------------
+void printDirectory(std::ostream& out,
+                    const std::string& imagePath,
+                    const std::vector<Rt11Entry>& entries,
+                    bool brief,
+                    bool showEmpty,
+                    ListFormat format);
+void showDirectory(BlockCache& cache,
+                   const std::string& imagePath,
+                   bool brief,
+                   bool showEmpty,
+                   bool useIndex = false,
+                   ListFormat format = ListFormat::Text);
+
+// ------------------------------
+// Catalog of an image tree (/catalog)
+// ------------------------------
+bool looksLikeImage(const std::filesystem::path& p);
+std::vector<std::filesystem::path> findImages(const std::filesystem::path& root);
+void formatCatalogEntries(const std::string& image,
+                          const std::vector<Rt11Entry>& entries,
+                          bool showEmpty,
+                          std::ostream& out);
+void catalogImages(const std::string& root,
+                   bool showEmpty,
+                   unsigned jobs,
+                   bool useIndex,
+                   ListFormat format = ListFormat::Text);
+
+// ------------------------------
+// Copy FROM RT-11 -> Windows
+// ------------------------------
+void copyExtentToFile(BlockDevice& dev,
+                      uint32_t start,
+                      uint32_t count,
+                      const std::filesystem::path& outPath,
+                      IoQueue* io = nullptr);
+void copySingleFromRt11(BlockDevice& dev,
+                        const Rt11Entry& e,
+                        const std::filesystem::path& outPath,
+                        bool noReplace,
+                        std::ostream& log,
+                        IoQueue* io = nullptr);
+void copyFromRt11Parallel(BlockDevice& dev,
+                          const std::vector<const Rt11Entry*>& matches,
+                          const std::filesystem::path& destDir,
+                          bool noReplace,
+                          unsigned jobs,
+                          std::ostream& log);
+void copyFromEntries(BlockCache& cache,
+                     const std::vector<Rt11Entry>& entries,
+                     const Rt11PatternSet& patterns,
+                     const std::string& toPathRaw,
+                     bool noReplace,
+                     unsigned jobs,
+                     std::ostream& log,
+                     bool asyncIo = false);
+void copyFromRt11(BlockCache& cache,
+                  const std::string& imagePath,
+                  const Rt11PatternSet& patterns,
+                  const std::string& toPathRaw,
+                  bool noReplace,
+                  unsigned jobs = 1,
+                  bool useIndex = false,
+                  bool asyncIo = false);
+
+// ------------------------------
+// Windows wildcard matching and expansion (for /copyto)
+// ------------------------------
+bool matchFsName(const std::string& name, const std::string& pattern);
+bool hasFsWildcard(const std::string& s);
+std::vector<std::filesystem::path> expandWindowsWildcard(const std::string& pattern);
+
+// ------------------------------
+// Free space index and allocation policies (for /copyto)
+// ------------------------------
+enum class AllocPolicy {
+    FirstFit,   // lowest-addressed empty area that fits (RT-11 .ENTER with a size)
+    BestFit,    // smallest empty area that fits
+    WorstFit,   // largest empty area
+    Rt11,       // RT-11 .ENTER [0] rule: larger of half the largest or the second largest
+};
+
+bool parseAllocPolicy(const std::string& s, AllocPolicy& policy);
+
+// Empty areas of a directory, ordered by address and by size.  Equal sizes
+// keep address order, so every policy breaks ties towards the low end.
+class FreeExtentIndex {
+public:
+    explicit FreeExtentIndex(const std::vector<Rt11Entry>& entries) {
+        DirectoryColumns cols(entries);
+        for (size_t i = 0; i < cols.size(); ++i) {
+            if ((cols.status[i] & (E_MPTY | E_PERM | E_TENT)) != E_MPTY) continue;
+            if (cols.lengthBlocks[i] == 0) continue;
+            byAddress_.push_back({cols.startBlock[i], cols.lengthBlocks[i], i});
+            totalFree_ += cols.lengthBlocks[i];
+        }
+        bySize_ = byAddress_;
+        std::stable_sort(bySize_.begin(), bySize_.end(),
+                         [](const Extent& a, const Extent& b) { return a.length < b.length; });
+    }
+
+    // Index into the entries of the empty area to allocate `blocks` from,
+    // or -1 if none is large enough.
+    long choose(uint32_t blocks, AllocPolicy policy) const {
+        if (bySize_.empty() || largest() < blocks) return -1;
+
+        switch (policy) {
+        case AllocPolicy::FirstFit:
+            for (const auto& x : byAddress_) {
+                if (x.length >= blocks) return static_cast<long>(x.entry);
+            }
+            return -1;
+
+        case AllocPolicy::BestFit: {
+            auto it = std::lower_bound(bySize_.begin(), bySize_.end(), blocks,
+                                       [](const Extent& x, uint32_t n) { return x.length < n; });
+            return static_cast<long>(it->entry);
+        }
+
+        case AllocPolicy::WorstFit:
+            return static_cast<long>(firstOfLargest().entry);
+
+        case AllocPolicy::Rt11: {
+            const Extent& big = firstOfLargest();
+            if (bySize_.size() > 1) {
+                // Second largest: the top of the size order, skipping the one chosen above
+                const Extent& a = bySize_[bySize_.size() - 1];
+                const Extent& b = bySize_[bySize_.size() - 2];
+                const Extent& second = (&a == &big) ? b : a;
+                if (second.length >= big.length / 2 && second.length >= blocks) {
+                    return static_cast<long>(second.entry);
+                }
+            }
+            return static_cast<long>(big.entry);
+        }
+        }
+        return -1;
+    }
+
+    size_t count() const       { return byAddress_.size(); }
+    uint32_t totalFree() const { return totalFree_; }
+    uint32_t largest() const   { return bySize_.empty() ? 0 : bySize_.back().length; }
+
+private:
+    struct Extent {
+        uint16_t start;
+        uint16_t length;
+        size_t entry;
+    };
+
+    // Lowest-addressed of the largest empty areas
+    const Extent& firstOfLargest() const {
+        auto it = std::lower_bound(bySize_.begin(), bySize_.end(), bySize_.back().length,
+                                   [](const Extent& x, uint32_t n) { return x.length < n; });
+        return *it;
+    }
+
+    std::vector<Extent> byAddress_;
+    std::vector<Extent> bySize_;
+    uint32_t totalFree_ = 0;
+};
+
+void printFreeSpace(const char* label, const FreeExtentIndex& index, std::ostream& out = std::cout);
+
+// ------------------------------
+// In-memory directory (for /copyto)
+// ------------------------------
+// All segments of the directory, decoded to words.  /copyto plans every
+// allocation and segment split against this copy and writes the changed
+// segments back once, after the file data is on the image.
+struct DirectoryImage {
+    uint32_t firstDirBlock = 0;
+    std::vector<std::array<uint16_t, 512>> segs;   // segs[n-1] = segment n
+    std::vector<bool> dirty;
+
+    uint16_t* words(uint16_t segNum) { return segs[segNum - 1].data(); }
+    const uint16_t* words(uint16_t segNum) const { return segs[segNum - 1].data(); }
+    uint16_t segmentCount() const { return static_cast<uint16_t>(segs.size()); }
+};
+
+void loadDirectoryImage(BlockCache& cache, DirectoryImage& dir);
+void storeDirectoryImage(BlockCache& cache, DirectoryImage& dir);
+void listDirectoryImage(const DirectoryImage& dir, std::vector<Rt11Entry>& entries);
+void readDirectoryStrict(BlockCache& cache, std::vector<Rt11Entry>& entries);
+void splitDirectorySegment(DirectoryImage& dir, uint16_t segToSplit);
+bool allocateInSegment(uint16_t* words,
+                       uint16_t idx,
+                       const std::string& rtname,
+                       uint16_t blocks,
+                       uint16_t dateW);
+
+// ------------------------------
+// Copy TO RT-11 (Windows -> RT-11)
+// ------------------------------
+struct CopyPlan {
+    std::filesystem::path srcPath;
+    std::string rtname;
+    uintmax_t bytes = 0;
+    uint32_t startBlock = 0;
+    uint32_t blocks = 0;
+};
+
+uint32_t allocateFile(DirectoryImage& dir,
+                      uint32_t totalBlocks,
+                      const std::string& rtname,
+                      uint32_t blocks,
+                      uint16_t dateW,
+                      AllocPolicy policy);
+bool planCopyToRt11(DirectoryImage& dir,
+                    uint32_t totalBlocks,
+                    const std::filesystem::path& srcPath,
+                    bool noReplace,
+                    uint16_t dateW,
+                    AllocPolicy policy,
+                    CopyPlan& plan,
+                    std::ostream& log);
+void copySingleToRt11(BlockCache& cache, const CopyPlan& plan, IoQueue* io = nullptr);
+void copyToRt11(BlockCache& cache,
+                const std::string& imagePath,
+                const std::string& fromPatternRaw,
+                bool noReplace,
+                uint16_t optionalDateWord = 0,
+                AllocPolicy policy = AllocPolicy::FirstFit,
+                bool reportFreeSpace = false,
+                std::ostream& log = std::cout,
+                bool asyncIo = false);
+
+// ------------------------------
+// Squeeze (compact the volume)
+// ------------------------------
+void moveBlocksDown(BlockCache& cache, uint32_t from, uint32_t to, uint32_t count);
+void squeezeVolume(BlockCache& cache, const std::string& imagePath);
+
+// ------------------------------
+// Overlays (/overlay, /commit, /flatten)
+// ------------------------------
+void commitOverlay(const std::string& imagePath, const std::string& overlayPath, std::ostream& log = std::cout);
+void flattenOverlay(const std::string& imagePath,
+                    const std::string& overlayPath,
+                    const std::string& outPath,
+                    std::ostream& log = std::cout);
+
+// ------------------------------
+// Volume verify (/verify)
+// ------------------------------
+// Errors are damage that RT-11 or this tool would trip over; warnings are
+// oddities that leave the volume usable (a home-block checksum that was
+// never written, tentative files, blocks past the last extent).
+struct VerifyIssue {
+    bool error = false;
+    const char* check = "";   // home, header, chain, entry or extent
+    uint16_t segment = 0;     // 0 when not tied to one segment
+    std::string message;
+};
+
+struct VerifyReport {
+    std::vector<VerifyIssue> issues;
+    uint32_t totalBlocks = 0;
+    uint16_t segments = 0;    // segments in the chain
+    uint32_t files = 0;
+    uint32_t usedBlocks = 0;
+    uint32_t freeBlocks = 0;
+
+    size_t errors() const;
+    size_t warnings() const { return issues.size() - errors(); }
+};
+
+bool verifyHomeBlock(const uint16_t* home, VerifyReport& report);
+VerifyReport verifyVolume(BlockCache& cache, unsigned jobs = 1, bool homeOnly = false);
+VerifyReport verifyHomeBlockFile(const std::string& imagePath);
+void writeVerifyReport(std::ostream& out, const std::string& image, const VerifyReport& report, ListFormat format);
+size_t verifyImages(const std::string& root, unsigned jobs, ListFormat format, bool homeOnly = false);
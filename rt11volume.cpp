@@ -0,0 +1,317 @@
+#include "rt11.h"
+#include "rt11engine.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <new>
+
+namespace rt11 {
+
+const char* errorText(Error error) {
+    switch (error) {
+    case Error::None:            return "No error";
+    case Error::NotOpen:         return "No image is open";
+    case Error::OpenFailed:      return "Cannot open disk image";
+    case Error::ReadOnly:        return "Disk image is not open for writing";
+    case Error::Io:              return "I/O error";
+    case Error::BadDirectory:    return "Directory is damaged";
+    case Error::NotFound:        return "File not found";
+    case Error::Exists:          return "File already exists";
+    case Error::InvalidName:     return "Invalid RT-11 file name";
+    case Error::InvalidArgument: return "Invalid argument";
+    case Error::DirectoryFull:   return "Directory full";
+    case Error::NoSpace:         return "No empty area large enough";
+    case Error::Failed:          break;
+    }
+    return "Operation failed";
+}
+
+struct Volume::Impl {
+    std::unique_ptr<BlockDevice> dev;
+    std::unique_ptr<BlockCache> cache;
+    std::string lastError;
+
+    Error fail(Error error, const std::string& message) {
+        lastError = message;
+        return error;
+    }
+
+    // Runs one operation on the open image and turns what it throws into a
+    // code.  Directory blocks a failed operation left dirty in the cache are
+    // dropped, so the image keeps its last complete state.
+    template <class Op>
+    Error run(Op op) {
+        if (!cache) return fail(Error::NotOpen, errorText(Error::NotOpen));
+        try {
+            return op();
+        } catch (const Rt11Error& ex) {
+            cache = std::make_unique<BlockCache>(*dev);
+            return fail(ex.code(), ex.what());
+        } catch (const std::bad_alloc&) {
+            cache = std::make_unique<BlockCache>(*dev);
+            return fail(Error::Failed, "Out of memory");
+        } catch (const std::exception& ex) {
+            cache = std::make_unique<BlockCache>(*dev);
+            return fail(Error::Failed, ex.what());
+        }
+    }
+
+    // NAME.EXT taken as given: unlike /copyto, nothing is truncated
+    static bool rt11Name(const std::string& name, std::string& rtname, uint16_t rad50[3]) {
+        rtname.clear();
+        for (char c : name) rtname += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+
+        auto dot = rtname.find('.');
+        size_t baseLen = (dot == std::string::npos) ? rtname.size() : dot;
+        size_t extLen  = (dot == std::string::npos) ? 0 : rtname.size() - dot - 1;
+        if (baseLen == 0 || baseLen > 6 || extLen > 3) return false;
+        for (size_t i = 0; i < rtname.size(); ++i) {
+            if (i == dot) continue;
+            char c = rtname[i];
+            if (c == '.' || c == ' ' || rad50Index(c) == 0) return false;
+        }
+        if (dot != std::string::npos && extLen == 0) rtname.pop_back();
+
+        encodeFileName(rtname, rad50[0], rad50[1], rad50[2]);
+        return true;
+    }
+
+    static FileInfo info(const Rt11Entry& e) {
+        FileInfo f;
+        f.name         = e.permanent() ? e.name() : std::string();
+        f.status       = e.status;
+        f.startBlock   = e.startBlock;
+        f.lengthBlocks = e.lengthBlocks;
+        f.dateWord     = e.dateWord;
+        f.segment      = e.segNumber;
+        return f;
+    }
+
+    static AllocPolicy policy(Placement placement) {
+        switch (placement) {
+        case Placement::BestFit:  return AllocPolicy::BestFit;
+        case Placement::WorstFit: return AllocPolicy::WorstFit;
+        case Placement::Rt11:     return AllocPolicy::Rt11;
+        case Placement::FirstFit: break;
+        }
+        return AllocPolicy::FirstFit;
+    }
+
+    static const Rt11Entry* findEntry(const std::vector<Rt11Entry>& entries, const uint16_t rad50[3]) {
+        for (const auto& e : entries) {
+            if (e.permanent() && std::equal(rad50, rad50 + 3, e.rad50)) return &e;
+        }
+        return nullptr;
+    }
+
+    Error checkRange(const FileInfo& file, uint32_t block, uint32_t count) {
+        if (!file.permanent() || block > file.lengthBlocks || count > file.lengthBlocks - block)
+            return fail(Error::InvalidArgument, "Blocks " + std::to_string(block) + "+" +
+                                                std::to_string(count) + " are outside " + file.name);
+        return Error::None;
+    }
+
+    void read(uint32_t block, uint32_t count, uint8_t* data) {
+        while (count > 0) {
+            uint32_t n = std::min(count, COPY_CHUNK_BLOCKS);
+            std::memcpy(data, cache->readExtent(block, n), static_cast<size_t>(n) * BLOCK_SIZE);
+            data  += static_cast<size_t>(n) * BLOCK_SIZE;
+            block += n;
+            count -= n;
+        }
+    }
+};
+
+Volume::Volume() : impl_(std::make_unique<Impl>()) {}
+Volume::~Volume() = default;
+Volume::Volume(Volume&&) noexcept = default;
+Volume& Volume::operator=(Volume&&) noexcept = default;
+
+Error Volume::open(const std::string& path, bool writable) {
+    close();
+    try {
+        impl_->dev = std::make_unique<BlockDevice>(path, writable);
+        impl_->cache = std::make_unique<BlockCache>(*impl_->dev);
+    } catch (const Rt11Error& ex) {
+        impl_->dev.reset();
+        return impl_->fail(ex.code(), ex.what());
+    } catch (const std::exception& ex) {
+        impl_->dev.reset();
+        return impl_->fail(Error::OpenFailed, ex.what());
+    }
+    return Error::None;
+}
+
+void Volume::close() {
+    impl_->cache.reset();
+    impl_->dev.reset();
+}
+
+bool Volume::isOpen() const     { return impl_->cache != nullptr; }
+bool Volume::writable() const   { return impl_->dev && impl_->dev->writable(); }
+uint32_t Volume::totalBlocks() const { return impl_->dev ? impl_->dev->totalBlocks() : 0; }
+const std::string& Volume::lastError() const { return impl_->lastError; }
+
+Error Volume::directory(std::vector<FileInfo>& files, bool all) {
+    return impl_->run([&] {
+        DirectoryImage dir;
+        loadDirectoryImage(*impl_->cache, dir);
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+
+        files.clear();
+        for (const auto& e : entries) {
+            if (all || e.permanent()) files.push_back(Impl::info(e));
+        }
+        return Error::None;
+    });
+}
+
+Error Volume::find(const std::string& name, FileInfo& file) {
+    return impl_->run([&] {
+        std::string rtname;
+        uint16_t rad50[3];
+        if (!Impl::rt11Name(name, rtname, rad50)) return impl_->fail(Error::InvalidName, name);
+
+        DirectoryImage dir;
+        loadDirectoryImage(*impl_->cache, dir);
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+
+        const Rt11Entry* e = Impl::findEntry(entries, rad50);
+        if (!e) return impl_->fail(Error::NotFound, rtname);
+        file = Impl::info(*e);
+        return Error::None;
+    });
+}
+
+Error Volume::freeSpace(uint32_t& freeBlocks, uint32_t& largestArea) {
+    return impl_->run([&] {
+        DirectoryImage dir;
+        loadDirectoryImage(*impl_->cache, dir);
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+
+        FreeExtentIndex index(entries);
+        freeBlocks  = index.totalFree();
+        largestArea = index.largest();
+        return Error::None;
+    });
+}
+
+Error Volume::allocate(const std::string& name, uint32_t blocks, FileInfo& file,
+                       uint16_t dateWord, Placement placement)
+{
+    return impl_->run([&] {
+        if (!writable()) return impl_->fail(Error::ReadOnly, errorText(Error::ReadOnly));
+        std::string rtname;
+        uint16_t rad50[3];
+        if (!Impl::rt11Name(name, rtname, rad50)) return impl_->fail(Error::InvalidName, name);
+        if (blocks == 0) return impl_->fail(Error::InvalidArgument, "A file needs at least one block");
+
+        DirectoryImage dir;
+        loadDirectoryImage(*impl_->cache, dir);
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+        if (Impl::findEntry(entries, rad50)) return impl_->fail(Error::Exists, rtname);
+
+        uint16_t dateW = dateWord ? dateWord : encodeRt11DateFromSystem();
+        uint32_t start = allocateFile(dir, impl_->cache->totalBlocks(), rtname, blocks,
+                                      dateW, Impl::policy(placement));
+        storeDirectoryImage(*impl_->cache, dir);
+        impl_->cache->flush();
+
+        listDirectoryImage(dir, entries);
+        for (const auto& e : entries) {
+            if (e.permanent() && e.startBlock == start) file = Impl::info(e);
+        }
+        return Error::None;
+    });
+}
+
+Error Volume::readFile(const std::string& name, std::vector<uint8_t>& data) {
+    FileInfo file;
+    Error err = find(name, file);
+    if (err != Error::None) return err;
+
+    return impl_->run([&] {
+        if (file.startBlock + file.lengthBlocks > impl_->cache->totalBlocks())
+            return impl_->fail(Error::BadDirectory, file.name + " extends beyond the end of the image");
+        data.resize(static_cast<size_t>(file.lengthBlocks) * BLOCK_SIZE);
+        impl_->read(file.startBlock, file.lengthBlocks, data.data());
+        return Error::None;
+    });
+}
+
+Error Volume::readBlocks(const FileInfo& file, uint32_t block, uint32_t count, uint8_t* data) {
+    return impl_->run([&] {
+        Error err = impl_->checkRange(file, block, count);
+        if (err != Error::None) return err;
+        impl_->read(file.startBlock + block, count, data);
+        return Error::None;
+    });
+}
+
+Error Volume::writeBlocks(const FileInfo& file, uint32_t block, uint32_t count, const uint8_t* data) {
+    return impl_->run([&] {
+        if (!writable()) return impl_->fail(Error::ReadOnly, errorText(Error::ReadOnly));
+        Error err = impl_->checkRange(file, block, count);
+        if (err != Error::None) return err;
+        impl_->cache->writeExtent(file.startBlock + block, data, count);
+        impl_->cache->flush();
+        return Error::None;
+    });
+}
+
+Error Volume::writeFile(const std::string& name, const uint8_t* data, size_t bytes,
+                        bool replace, uint16_t dateWord, Placement placement)
+{
+    return impl_->run([&] {
+        if (!writable()) return impl_->fail(Error::ReadOnly, errorText(Error::ReadOnly));
+        std::string rtname;
+        uint16_t rad50[3];
+        if (!Impl::rt11Name(name, rtname, rad50)) return impl_->fail(Error::InvalidName, name);
+
+        size_t blocks = std::max<size_t>(1, (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        if (blocks > 0xFFFF) return impl_->fail(Error::NoSpace, "File too large for an RT-11 volume");
+
+        DirectoryImage dir;
+        loadDirectoryImage(*impl_->cache, dir);
+        std::vector<Rt11Entry> entries;
+        listDirectoryImage(dir, entries);
+        bool exists = Impl::findEntry(entries, rad50) != nullptr;
+        if (exists && !replace) return impl_->fail(Error::Exists, rtname);
+
+        uint16_t dateW = dateWord ? dateWord : encodeRt11DateFromSystem();
+        uint32_t start = allocateFile(dir, impl_->cache->totalBlocks(), rtname,
+                                      static_cast<uint32_t>(blocks), dateW, Impl::policy(placement));
+
+        // Data first, then the directory, as /copyto does
+        uint32_t whole = static_cast<uint32_t>(bytes / BLOCK_SIZE);
+        if (whole > 0) impl_->cache->writeExtent(start, data, whole);
+        if (whole < blocks) {
+            uint8_t last[BLOCK_SIZE] = {};
+            if (bytes % BLOCK_SIZE)
+                std::memcpy(last, data + static_cast<size_t>(whole) * BLOCK_SIZE, bytes % BLOCK_SIZE);
+            impl_->cache->writeExtent(start + whole, last, 1);
+        }
+
+        if (exists) {
+            // Segment splits may have moved the old entry
+            listDirectoryImage(dir, entries);
+            for (const auto& e : entries) {
+                if (e.permanent() && e.startBlock != start && std::equal(rad50, rad50 + 3, e.rad50)) {
+                    dir.words(e.segNumber)[e.wordIndex] = E_MPTY;
+                    dir.dirty[e.segNumber - 1] = true;
+                }
+            }
+        }
+
+        storeDirectoryImage(*impl_->cache, dir);
+        impl_->cache->flush();
+        return Error::None;
+    });
+}
+
+} // namespace rt11